@@ -0,0 +1,92 @@
+/*****************************************************************************
+
+NAME
+   arena.c -- bump-pointer storage for parse trees and symbols
+
+SYNOPSIS
+   void *arena_alloc(size_t n)		-- allocate zeroed storage
+   char *arena_strdup(const char *s)	-- copy a string into the arena
+   void arena_release(void)		-- free everything at once
+
+DESCRIPTION
+   Parse-tree nodes, interned strings and symbol records live exactly as
+long as the program they describe, so rather than malloc them one at a
+time we carve them out of large chunks and throw the chunks away together
+once the program has run.  Storage is suitably aligned for any type and
+is zeroed.  With accounting on, what is handed out is charged to parse
+storage; the slack at the ends of chunks is not.
+
+LICENSE
+   SPDX-License-Identifier: BSD-2-clause
+
+*****************************************************************************/
+/*LINTLIBRARY*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include "cupl.h"
+
+#define CHUNKSIZE	65536	/* default chunk size, in bytes */
+
+typedef struct chunk
+{
+    struct chunk	*next;		/* previously filled chunk */
+    size_t		size;		/* bytes available in data */
+    size_t		used;		/* bytes handed out so far */
+    max_align_t		data[];		/* the storage itself */
+}
+chunk;
+
+static chunk *chunks;	/* most recent chunk first */
+
+void *arena_alloc(size_t n)
+/* allocate n bytes of zeroed storage that lives until arena_release() */
+{
+    void	*p;
+
+    /* round up so the next allocation stays aligned */
+    n = (n + sizeof(max_align_t) - 1) / sizeof(max_align_t) * sizeof(max_align_t);
+
+    if (chunks == (chunk *)NULL || chunks->used + n > chunks->size)
+    {
+	size_t	size = (n > CHUNKSIZE) ? n : CHUNKSIZE;
+	chunk	*new;
+
+	if ((new = (chunk *)calloc(sizeof(chunk) + size, 1)) == (chunk *)NULL)
+	    die(NOMEM);
+	new->size = size;
+	new->next = chunks;
+	chunks = new;
+    }
+
+    p = (char *)chunks->data + chunks->used;
+    chunks->used += n;
+    if (accounting)
+	account_alloc(ALLOC_PARSE, n);
+    return(p);
+}
+
+char *arena_strdup(const char *s)
+/* copy a string into the arena */
+{
+    size_t	n = strlen(s) + 1;
+
+    return((char *)memcpy(arena_alloc(n), s, n));
+}
+
+void arena_release(void)
+/* free all arena storage at once */
+{
+    while (chunks)
+    {
+	chunk	*next = chunks->next;
+
+	if (accounting)
+	    account_free(ALLOC_PARSE, chunks->used);
+	free(chunks);
+	chunks = next;
+    }
+}
+
+/* arena.c ends here */
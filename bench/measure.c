@@ -0,0 +1,88 @@
+/*****************************************************************************
+
+NAME
+   measure.c -- time a command and report its peak memory, for RUNBENCH
+
+SYNOPSIS
+   measure command [arg...]
+
+DESCRIPTION
+   Runs the command with its standard output and standard error thrown
+away, waits for it, and writes its wall-clock time in seconds and its
+peak resident set size in kilobytes on one line of standard output.
+The exit status is the command's, or 1 if it could not be run or was
+killed by a signal.
+
+LICENSE
+   SPDX-License-Identifier: BSD-2-clause
+
+*****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+static double now(void)
+/* the monotonic clock in seconds */
+{
+    struct timespec	ts;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+    return(ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct rusage	ru;
+    double		start, wall;
+    pid_t		pid;
+    int			status, fd;
+
+    if (argc < 2)
+    {
+	(void) fprintf(stderr, "usage: measure command [arg...]\n");
+	return(1);
+    }
+
+    start = now();
+    if ((pid = fork()) < 0)
+    {
+	perror("measure: fork");
+	return(1);
+    }
+    else if (pid == 0)
+    {
+	if ((fd = open("/dev/null", O_WRONLY)) >= 0)
+	{
+	    (void) dup2(fd, 1);
+	    (void) dup2(fd, 2);
+	    (void) close(fd);
+	}
+	(void) execvp(argv[1], argv + 1);
+	_exit(127);
+    }
+
+    /* the command is our only child, so its peak is the children's */
+    if (waitpid(pid, &status, 0) < 0 || getrusage(RUSAGE_CHILDREN, &ru) < 0)
+    {
+	perror("measure");
+	return(1);
+    }
+    wall = now() - start;
+
+    /* Linux and the BSDs give ru_maxrss in kilobytes; Darwin in bytes */
+#ifdef __APPLE__
+    ru.ru_maxrss /= 1024;
+#endif /* __APPLE__ */
+    (void) printf("%.6f %ld\n", wall, (long)ru.ru_maxrss);
+
+    return(WIFEXITED(status) ? WEXITSTATUS(status) : 1);
+}
+
+/* measure.c ends here */
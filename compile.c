@@ -0,0 +1,573 @@
+/*****************************************************************************
+
+NAME
+   compile.c -- lower a parse tree to bytecode
+
+SYNOPSIS
+   program *compile(node *tree)		-- compile a parse tree
+   void disassemble(program *prog)	-- dump a compiled program
+
+DESCRIPTION
+   This code lowers a checked, label-resolved CUPL parse tree to the flat
+register-based bytecode run by execute().  Each statement is compiled
+in place, so control flows through the code exactly as it flows through
+the statement list in cupl_eval(): a BLOCK statement becomes a jump past
+its END, an END or GO TO ... END becomes a return, a GO TO becomes a
+jump, and PERFORM becomes a call.  Registers are allocated stack-fashion
+within each statement; a PERFORM activation gets its own register window,
+so loop state survives recursive PERFORMs.
+
+   Where rank inference has shown that the operands of an operation are
+scalars (see is_scalar()), the operation is compiled to a scalar-only
+form that works on the numbers directly, with no rank or shape checks.
+
+   Anything not lowered here is compiled to OP_EVAL, which hands the
+subtree to cupl_eval().
+
+LICENSE
+   SPDX-License-Identifier: BSD-2-clause
+
+*****************************************************************************/
+/*LINTLIBRARY*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "cupl.h"
+#include "tokens.h"
+
+static program *prog;	/* program being compiled */
+static int maxinsns;	/* instructions allocated */
+
+/* statement-to-address map, used to resolve branch targets */
+typedef struct
+{
+    node	*stmt;
+    int		addr;
+}
+address;
+
+static address *addresses;
+static int naddresses, maxaddresses;
+
+/* branches waiting for their target addresses */
+static address *fixups;
+static int nfixups, maxfixups;
+
+/****************************************************************************
+ *
+ * Code emission
+ *
+ ****************************************************************************/
+
+static insn *emit(enum opcode op, int dst, int a, int b)
+/* append an instruction, valid until the next emit */
+{
+    insn *ip;
+
+    if (prog->ninsns >= maxinsns)
+    {
+	maxinsns = maxinsns ? maxinsns * 2 : 256;
+	prog->code = (insn *)realloc(prog->code, sizeof(insn) * maxinsns);
+	if (prog->code == (insn *)NULL)
+	    die(NOMEM);
+    }
+
+    ip = prog->code + prog->ninsns;
+    ip->op = op;
+    ip->dst = dst;
+    ip->a = a;
+    ip->b = b;
+    ip->target = 0;
+    ip->var = (lvar *)NULL;
+    ip->slot = 0;
+    ip->tree = NULLNODE;
+    ip->f.fn1 = NULL;
+
+    if (dst >= prog->nregs)
+	prog->nregs = dst + 1;
+    if (a >= prog->nregs)
+	prog->nregs = a + 1;
+    if (b >= prog->nregs)
+	prog->nregs = b + 1;
+
+    prog->ninsns++;
+    return(ip);
+}
+
+static insn *bind(insn *ip, node *id)
+/* attach a variable operand to an instruction */
+{
+    ip->var = id->syminf;
+    ip->slot = id->syminf->slot;
+    return(ip);
+}
+
+static void record(address **list, int *count, int *size, node *stmt, int addr)
+/* add an entry to an address list */
+{
+    if (*count >= *size)
+    {
+	*size = *size ? *size * 2 : 64;
+	*list = (address *)realloc(*list, sizeof(address) * *size);
+	if (*list == (address *)NULL)
+	    die(NOMEM);
+    }
+    (*list)[*count].stmt = stmt;
+    (*list)[*count].addr = addr;
+    ++*count;
+}
+
+static void branch(insn *ip, node *stmt)
+/* arrange for an instruction to branch to statement stmt */
+{
+    record(&fixups, &nfixups, &maxfixups, stmt, (int)(ip - prog->code));
+}
+
+static int forward(enum opcode op, int a)
+/* append a branch to be patched later, returning its address */
+{
+    emit(op, 0, a, 0);
+    return(prog->ninsns - 1);
+}
+
+static void patch(int addr)
+/* point a forward branch at the next instruction */
+{
+    prog->code[addr].target = prog->ninsns;
+}
+
+static int compare_addresses(const void *a, const void *b)
+{
+    const node *left = ((const address *)a)->stmt;
+    const node *right = ((const address *)b)->stmt;
+
+    return((left > right) - (left < right));
+}
+
+/****************************************************************************
+ *
+ * Expressions
+ *
+ ****************************************************************************/
+
+static void compile_expr(node *tp, int dst)
+/* compile an expression, leaving its value in register dst */
+{
+    insn *ip;
+    node *np;
+
+    switch (tp->type)
+    {
+    case NUMBER:
+	emit(OP_CONST, dst, 0, 0)->tree = tp;
+	break;
+
+    case IDENTIFIER:
+	bind(emit(is_scalar(tp) ? OP_SLOAD : OP_LOAD, dst, 0, 0), tp);
+	break;
+
+    case PLUS:
+    case MINUS:
+    case MULTIPLY:
+    case DIVIDE:
+    case POWER:
+    case '=':
+    case NE:
+    case LT:
+    case GT:
+    case LE:
+    case GE:
+	compile_expr(tp->car, dst);
+	compile_expr(tp->cdr, dst + 1);
+	if (is_scalar(tp->car) && is_scalar(tp->cdr))
+	    switch (tp->type)
+	    {
+	    case PLUS:	ip = emit(OP_SADD, dst, dst, dst + 1); break;
+	    case MINUS:	ip = emit(OP_SSUBTRACT, dst, dst, dst + 1); break;
+	    case MULTIPLY: ip = emit(OP_SMULTIPLY, dst, dst, dst + 1); break;
+	    case DIVIDE: ip = emit(OP_SDIVIDE, dst, dst, dst + 1); break;
+	    case POWER:	ip = emit(OP_SPOWER, dst, dst, dst + 1); break;
+	    case '=':	ip = emit(OP_SEQ, dst, dst, dst + 1); break;
+	    case NE:	ip = emit(OP_SNE, dst, dst, dst + 1); break;
+	    case LT:	ip = emit(OP_SLT, dst, dst, dst + 1); break;
+	    case GT:	ip = emit(OP_SGT, dst, dst, dst + 1); break;
+	    case LE:	ip = emit(OP_SLE, dst, dst, dst + 1); break;
+	    default:	ip = emit(OP_SGE, dst, dst, dst + 1); break;
+	    }
+	else
+	    switch (tp->type)
+	    {
+	    case PLUS:	ip = emit(OP_ADD, dst, dst, dst + 1); break;
+	    case MINUS:	ip = emit(OP_SUBTRACT, dst, dst, dst + 1); break;
+	    case MULTIPLY: ip = emit(OP_MULTIPLY, dst, dst, dst + 1); break;
+	    case DIVIDE: ip = emit(OP_DIVIDE, dst, dst, dst + 1); break;
+	    case POWER:	ip = emit(OP_POWER, dst, dst, dst + 1); break;
+	    case '=':	ip = emit(OP_EQ, dst, dst, dst + 1); break;
+	    case NE:	ip = emit(OP_NE, dst, dst, dst + 1); break;
+	    case LT:	ip = emit(OP_LT, dst, dst, dst + 1); break;
+	    case GT:	ip = emit(OP_GT, dst, dst, dst + 1); break;
+	    case LE:	ip = emit(OP_LE, dst, dst, dst + 1); break;
+	    default:	ip = emit(OP_GE, dst, dst, dst + 1); break;
+	    }
+	ip->tree = tp;
+	break;
+
+    case AND:
+    case OR:
+	compile_expr(tp->car, dst);
+	compile_expr(tp->cdr, dst + 1);
+	ip = emit(tp->type == AND ? OP_AND : OP_OR, dst, dst, dst + 1);
+	ip->tree = tp;
+	break;
+
+    case UMINUS:
+	compile_expr(tp->cdr, dst);
+	emit(is_scalar(tp->cdr) ? OP_SUMINUS : OP_UMINUS, dst, dst, 0)->tree = tp;
+	break;
+
+    case ABS:
+	compile_expr(tp->cdr, dst);
+	emit(is_scalar(tp->cdr) ? OP_SABS : OP_ABS, dst, dst, 0)->tree = tp;
+	break;
+
+    case ATAN:
+    case COS:
+    case EXP:
+    case FLOOR:
+    case LOG:
+    case LN:
+    case SQRT:
+	if (is_scalar(tp->cdr))
+	{
+	    compile_expr(tp->cdr, dst);
+	    ip = emit(OP_SFUNC, dst, dst, 0);
+	    ip->tree = tp;
+	    switch (tp->type)
+	    {
+	    case ATAN:	ip->f.sfn = atan; break;
+	    case COS:	ip->f.sfn = cos; break;
+	    case EXP:	ip->f.sfn = exp; break;
+	    case FLOOR:	ip->f.sfn = floor; break;
+	    case LOG:	ip->f.sfn = log10; break;
+	    case LN:	ip->f.sfn = log; break;
+	    default:	ip->f.sfn = sqrt; break;
+	    }
+	    break;
+	}
+	/* FALL THROUGH */
+    case RAND:
+    case DET:
+    case INV:
+    case POSMAX:
+    case POSMIN:
+    case SGM:
+    case TRC:
+    case TRN:
+	compile_expr(tp->cdr, dst);
+	ip = emit(OP_FUNC1, dst, dst, 0);
+	ip->tree = tp;
+	switch (tp->type)
+	{
+	case ATAN:	ip->f.fn1 = cupl_atan; break;
+	case COS:	ip->f.fn1 = cupl_cos; break;
+	case EXP:	ip->f.fn1 = cupl_exp; break;
+	case FLOOR:	ip->f.fn1 = cupl_floor; break;
+	case LOG:	ip->f.fn1 = cupl_log; break;
+	case LN:	ip->f.fn1 = cupl_ln; break;
+	case SQRT:	ip->f.fn1 = cupl_sqrt; break;
+	case RAND:	ip->f.fn1 = cupl_rand; break;
+	case DET:	ip->f.fn1 = cupl_det; break;
+	case INV:	ip->f.fn1 = cupl_inv; break;
+	case POSMAX:	ip->f.fn1 = cupl_posmax; break;
+	case POSMIN:	ip->f.fn1 = cupl_posmin; break;
+	case SGM:	ip->f.fn1 = cupl_sgm; break;
+	case TRC:	ip->f.fn1 = cupl_trc; break;
+	default:	ip->f.fn1 = cupl_trn; break;
+	}
+	break;
+
+    case DOT:
+	compile_expr(tp->car, dst);
+	compile_expr(tp->cdr, dst + 1);
+	ip = emit(OP_FUNC2, dst, dst, dst + 1);
+	ip->tree = tp;
+	ip->f.fn2 = cupl_dot;
+	break;
+
+    case MAX:
+    case MIN:
+	/* the cdr is a list of further arguments; fold them in pairwise */
+	compile_expr(tp->car, dst);
+	for_cdr(np, tp->cdr)
+	{
+	    compile_expr(np->car, dst + 1);
+	    ip = emit(OP_FUNC2, dst, dst, dst + 1);
+	    ip->tree = tp;
+	    ip->f.fn2 = (tp->type == MAX) ? cupl_max : cupl_min;
+	}
+	break;
+
+    default:
+	emit(OP_EVAL, dst, 0, 0)->tree = tp;
+	break;
+    }
+}
+
+/****************************************************************************
+ *
+ * Statements
+ *
+ ****************************************************************************/
+
+static void compile_statement(node *tp);
+
+static void compile_stepped(node *var, node *body)
+/* compile a stepped FOR loop, with start, limit and step in registers 0-2 */
+{
+    int	prep, top;
+
+    prep = forward(OP_FORPREP, 0);
+    bind(prog->code + prep, var);
+    top = prog->ninsns;
+    compile_statement(body);
+    bind(emit(OP_FORLOOP, 0, 0, 0), var)->target = top;
+    patch(prep);
+}
+
+static void compile_statement(node *tp)
+/* compile a simple or compound statement */
+{
+    int	ip, top;
+    node *np, *iterator;
+
+    switch (tp->type)
+    {
+    case LET:
+	compile_expr(tp->cdr, 0);
+	bind(emit(OP_STORE, 0, 0, 0), tp->car);
+	break;
+
+    case READ:
+	emit(OP_READ, 0, 0, 0)->tree = tp;
+	break;
+
+    case WRITE:
+	emit(OP_WRITE, 0, 0, 0)->tree = tp;
+	break;
+
+    case WATCH:
+	emit(OP_WATCH, 0, 0, 0)->tree = tp;
+	break;
+
+    case GO:
+	branch(emit(OP_JUMP, 0, 0, 0), tp->car);
+	break;
+
+    case OG:
+	/* FIXME: GOTO END ignores labels */
+    case END:
+	emit(OP_RETURN, 0, 0, 0);
+	break;
+
+    case STOP:
+	emit(OP_STOP, 0, 0, 0);
+	break;
+
+    case IF:
+	compile_expr(tp->car, 0);
+	ip = forward(OP_JUMPF, 0);
+	compile_statement(tp->cdr);
+	patch(ip);
+	break;
+
+    case IFELSE:
+	compile_expr(tp->car, 0);
+	ip = forward(OP_JUMPF, 0);
+	compile_statement(tp->cdr->car);
+	if (tp->cdr->cdr)
+	{
+	    int	skip = forward(OP_JUMP, 0);
+
+	    patch(ip);
+	    compile_statement(tp->cdr->cdr);
+	    ip = skip;
+	}
+	patch(ip);
+	break;
+
+    case PERFORM:
+	{
+	    insn	*call = emit(OP_CALL, 0, 0, 0);
+
+	    call->tree = tp->car;	/* the block, for profiling */
+	    branch(call, tp->car);
+	}
+	break;
+
+    case TIMES:
+	compile_expr(tp->car, 0);
+	ip = forward(OP_TIMES, 0);
+	top = prog->ninsns;
+	compile_statement(tp->cdr);
+	emit(OP_LOOP, 0, 0, 0)->target = top;
+	patch(ip);
+	break;
+
+    case WHILE:
+    case UNTIL:
+	top = prog->ninsns;
+	compile_statement(tp->cdr);
+	compile_expr(tp->car, 0);
+	emit(tp->type == WHILE ? OP_JUMPT : OP_JUMPF, 0, 0, 0)->target = top;
+	break;
+
+    case FOR:
+	iterator = tp->car;
+	if (iterator->type == '=')
+	{
+	    for_cdr(np, iterator->cdr)
+		if (np->car->type == TRIPLE)
+		{
+		    node *triple = np->car;
+
+		    /* same evaluation order as cupl_eval */
+		    compile_expr(triple->car, 0);
+		    compile_expr(triple->cdr->car, 2);
+		    compile_expr(triple->cdr->cdr, 1);
+		    compile_stepped(iterator->car, tp->cdr);
+		}
+		else
+		{
+		    compile_expr(np->car, 0);
+		    bind(emit(OP_STORE, 0, 0, 0), iterator->car);
+		    compile_statement(tp->cdr);
+		}
+	}
+	else if (iterator->type == ITERATE)
+	{
+	    static node one;
+	    node *to = iterator->cdr->cdr;
+
+	    one.type = NUMBER;
+	    one.u.numval = 1;
+	    compile_expr(iterator->cdr->car, 0);
+	    compile_expr(to->car, 1);
+	    compile_expr(to->cdr ? to->cdr : &one, 2);
+	    compile_stepped(iterator->car, tp->cdr);
+	}
+	else
+	    emit(OP_EVAL, 0, 0, 0)->tree = tp;
+	break;
+
+    default:
+	emit(OP_EVAL, 0, 0, 0)->tree = tp;
+	break;
+    }
+}
+
+program *compile(node *tree)
+/* compile a label-resolved program parse tree */
+{
+    node	*np;
+    int		n, ip;
+
+    if ((prog = (program *)calloc(sizeof(program), 1)) == (program *)NULL)
+	die(NOMEM);
+    maxinsns = naddresses = nfixups = 0;
+
+    for_cdr(np, tree)
+    {
+	/* execute() cuts the program off at the data */
+	if (np->car->type == DATA)
+	    break;
+
+	record(&addresses, &naddresses, &maxaddresses, np, prog->ninsns);
+	if (profiling && !translating)
+	    emit(OP_PROFILE, 0, 0, 0)->tree = np;
+	if (np->car->type == BLOCK)
+	    branch(emit(OP_JUMP, 0, 0, 0), np->endnode->cdr);
+	else
+	    compile_statement(np->car);
+    }
+
+    /* falling off the end, or into the data, finishes the PERFORM */
+    ip = prog->ninsns;
+    emit(OP_RETURN, 0, 0, 0);
+
+    qsort(addresses, naddresses, sizeof(address), compare_addresses);
+    for (n = 0; n < nfixups; n++)
+    {
+	address *ap = (address *)bsearch(&fixups[n], addresses, naddresses,
+					 sizeof(address), compare_addresses);
+
+	prog->code[fixups[n].addr].target = ap ? ap->addr : ip;
+    }
+
+    return(prog);
+}
+
+/****************************************************************************
+ *
+ * Debugging support
+ *
+ ****************************************************************************/
+
+static char *opnames[OP_COUNT] =
+{
+    "CONST", "LOAD", "STORE", "ADD", "SUBTRACT", "MULTIPLY", "DIVIDE",
+    "POWER", "UMINUS", "ABS", "FUNC1", "FUNC2", "EQ", "NE", "LT", "GT", "LE",
+    "GE", "AND", "OR", "JUMP", "JUMPT", "JUMPF", "CALL", "RETURN", "STOP",
+    "TIMES", "LOOP", "FORPREP", "FORLOOP", "READ", "WRITE", "WATCH", "EVAL",
+    "SLOAD", "SADD", "SSUBTRACT", "SMULTIPLY", "SDIVIDE", "SPOWER", "SUMINUS",
+    "SABS", "SFUNC", "SEQ", "SNE", "SLT", "SGT", "SLE", "SGE", "EXIT",
+    "PROFILE",
+};
+
+void disassemble(program *prog)
+/* dump a compiled program */
+{
+    insn	*ip;
+
+    (void) printf("Bytecode (%d instructions, %d registers):\n",
+		  prog->ninsns, prog->nregs);
+    for (ip = prog->code; ip < prog->code + prog->ninsns; ip++)
+    {
+	(void) printf("%6ld  %-9s r%d, r%d, r%d",
+		      (long)(ip - prog->code), opnames[ip->op],
+		      ip->dst, ip->a, ip->b);
+	switch (ip->op)
+	{
+	case OP_JUMP: case OP_JUMPT: case OP_JUMPF: case OP_CALL:
+	case OP_TIMES: case OP_LOOP:
+	    (void) printf("  -> %d", ip->target);
+	    break;
+
+	case OP_FORPREP: case OP_FORLOOP:
+	    (void) printf("  %s -> %d",
+			  ip->var->node->u.string, ip->target);
+	    break;
+
+	case OP_LOAD: case OP_SLOAD: case OP_STORE:
+	    (void) printf("  %s", ip->var->node->u.string);
+	    break;
+
+	case OP_CONST:
+	    (void) printf("  %f", ip->tree->u.numval);
+	    break;
+
+	case OP_PROFILE:
+	    (void) printf("  line %d", ip->tree->line);
+	    break;
+
+	case OP_FUNC1: case OP_FUNC2: case OP_SFUNC: case OP_EVAL:
+	    (void) printf("  (%s)", tokdump(ip->tree->type));
+	    break;
+
+	default:
+	    break;
+	}
+	(void) putchar('\n');
+    }
+}
+
+/* compile.c ends here */
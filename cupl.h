@@ -5,7 +5,7 @@
 /* maximum file size */
 #ifdef USG
 #include <limits.h>
-#else
+#elif !defined(PATH_MAX)
 #define PATH_MAX	1024
 #endif
 
@@ -16,6 +16,7 @@
 #define EXT	".cupl"		/* CUPL source file extension */
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdnoreturn.h>
 
 #define SUCCEED	0
@@ -58,6 +59,7 @@ typedef struct edon
     struct edon		*endnode;	/* end node address, if block label */
 #ifdef PARSEDEBUG
     int 		number;		/* statement number */
+    int			line;		/* source line it starts on */
 #endif /* PARSEDEBUG */
 }
 node;
@@ -69,21 +71,30 @@ node;
 
 #define for_cdr(x, t)    for (x = (t); x; x = x->u.n.right)
 
-/* this structure represents a CUPL value */
+/*
+ * This structure represents a CUPL value.  Scalars carry their one element
+ * inline, so that scalar arithmetic never touches the allocator; vectors
+ * and matrices keep their elements in a reference-counted buffer that
+ * copies share until one of them writes to it.
+ */
 typedef struct
 {
     int		rank;			/* 0, 1, or 2 */
     int		width, depth;		/* dimensions */
-    scalar	*elements;		/* elements */
+    scalar	*elements;		/* elements, if rank > 0 */
+    scalar	number;			/* the element, if rank == 0 */
 }
 value;
 
+/* element storage of a value of any rank; v must be an lvalue */
+#define ELEMENTS(v)	((v).rank ? (v).elements : &(v).number)
+
 /* access to the symbol list */
 typedef struct lvar_t
 {
     struct lvar_t	*next;		/* link to next variable */
     node		*node;		/* variable's symbol info */
-    value		value;		/* variable's value */
+    int			slot;		/* variable's index in frame */
     node		*target;	/* target node, if label */
 
     /* information used for consistency checks */
@@ -94,30 +105,199 @@ typedef struct lvar_t
     int		assigned;
     int		used;
     int		watchcount;
+
+    /* from rank inference */
+    bool	matrix;		/* might hold a vector or matrix? */
 }
 lvar;
 extern lvar *idlist;
+extern void clear_symbols(void);
 
-bool corc;	/* are we parsing CUPL or CORC? */ 
+extern bool corc;	/* are we parsing CUPL or CORC? */
 
 #define for_symbols(s)    for (s = idlist; s; s = s->next)
 
+/* variable values live together in one frame, indexed by slot */
+extern value *frame;
+extern int nslots;
+#define VALUE(lp)	(frame[(lp)->slot])
+
+/*
+ * Bytecode.  The checked, label-resolved parse tree is lowered to a flat
+ * array of register-based instructions by compile().  Registers are value
+ * slots local to each PERFORM activation; branch and call targets are
+ * instruction indices.
+ */
+enum opcode
+{
+    OP_CONST,		/* dst = number at tree */
+    OP_LOAD,		/* dst = copy of var */
+    OP_STORE,		/* var = a (with WATCH handling) */
+    OP_ADD,		/* dst = a + b */
+    OP_SUBTRACT,	/* dst = a - b */
+    OP_MULTIPLY,	/* dst = a * b */
+    OP_DIVIDE,		/* dst = a / b */
+    OP_POWER,		/* dst = a ** b */
+    OP_UMINUS,		/* dst = -a */
+    OP_ABS,		/* dst = abs(a) */
+    OP_FUNC1,		/* dst = fn1(a) */
+    OP_FUNC2,		/* dst = fn2(a, b) */
+    OP_EQ, OP_NE, OP_LT, OP_GT, OP_LE, OP_GE,	/* dst = a rel b */
+    OP_AND, OP_OR,	/* dst = a conj b */
+    OP_JUMP,		/* go to target */
+    OP_JUMPT,		/* go to target if a is true */
+    OP_JUMPF,		/* go to target if a is false */
+    OP_CALL,		/* PERFORM the block at target */
+    OP_RETURN,		/* return from PERFORM */
+    OP_STOP,		/* terminate the program */
+    OP_TIMES,		/* a = floor(a); go to target if it is zero */
+    OP_LOOP,		/* go to target if --a is nonzero */
+    OP_FORPREP,		/* var = a; go to target unless a <= a+1 */
+    OP_FORLOOP,		/* a += a+2; var = a, go to target if a <= a+1 */
+    OP_READ,		/* READ list at tree */
+    OP_WRITE,		/* WRITE list at tree */
+    OP_WATCH,		/* WATCH list at tree */
+    OP_EVAL,		/* dst = cupl_eval(tree) */
+
+    /* forms for operands rank inference has shown to be scalars */
+    OP_SLOAD,		/* dst = scalar var */
+    OP_SADD, OP_SSUBTRACT, OP_SMULTIPLY, OP_SDIVIDE, OP_SPOWER,
+			/* dst = a op b */
+    OP_SUMINUS,		/* dst = -a */
+    OP_SABS,		/* dst = abs(a) */
+    OP_SFUNC,		/* dst = sfn(a) */
+    OP_SEQ, OP_SNE, OP_SLT, OP_SGT, OP_SLE, OP_SGE,	/* dst = a rel b */
+
+    OP_EXIT,		/* leave, for checking native code; see jit.c */
+    OP_PROFILE,		/* statement at tree starts here, for -p */
+    OP_COUNT		/* must be last */
+};
+
+typedef struct
+{
+    enum opcode	op;		/* operation */
+    int		dst, a, b;	/* register operands */
+    int		target;		/* branch target */
+    lvar	*var;		/* variable operand */
+    int		slot;		/* its frame slot */
+    node	*tree;		/* source node */
+    union
+    {
+	value	(*fn1)(value);
+	value	(*fn2)(value, value);
+	scalar	(*sfn)(scalar);
+    } f;			/* intrinsic, for OP_FUNC1, OP_FUNC2 and OP_SFUNC */
+}
+insn;
+
+typedef struct
+{
+    insn	*code;		/* instructions */
+    int		ninsns;		/* count of instructions */
+    int		nregs;		/* registers per activation */
+}
+program;
+
+/*
+ * Native code for a block, called with the activation's registers and the
+ * frame.  It returns RAN_RETURN or RAN_STOP, or the index of the
+ * instruction the interpreter is to carry on from.
+ */
+typedef int (*jitfn)(value *r, value *frame);
+
+#define RAN_RETURN	-1	/* the PERFORM finished */
+#define RAN_STOP	-2	/* the program did */
+
 /* subscripting operations */
-#define SUB(v, i, j)	(v.elements + i * v.width + j)
+#define SUB(v, i, j)	(ELEMENTS(v) + i * v.width + j)
 #define SUBI(v, n)	(n / v.width)
 #define SUBJ(v, n)	(n % v.width)
 
 #define NOMEM	"out of memory\n"
 
+/* CUPL's notion of equality between scalars */
+#define FUZZ			10e-15
+#define FUZZY_EQUAL(m, n)	(fabs((m) - (n)) < FUZZ)
+
+/* simd.c */
+extern void vec_add(scalar *d, const scalar *l, const scalar *r, long n);
+extern void vec_subtract(scalar *d, const scalar *l, const scalar *r, long n);
+extern void vec_negate(scalar *d, const scalar *r, long n);
+extern void vec_abs(scalar *d, const scalar *r, long n);
+extern bool vec_all_eq(const scalar *l, const scalar *r, long n);
+extern bool vec_all_le(const scalar *l, const scalar *r, long n);
+extern bool vec_all_ge(const scalar *l, const scalar *r, long n);
+
+/* lu.c */
+extern int lu_factor(scalar *a, int n, int *piv);
+extern void lu_invert(scalar *a, int n, const int *piv, scalar *x);
+
+/* pool.c */
+extern void pool_threads(int n);
+extern void parallel_for(int n, long work,
+			 void (*fn)(void *, int, int), void *arg);
+
+/* matmul.c */
+extern void matmul(scalar *c, const scalar *a, const scalar *b,
+		   int m, int n, int k);
+extern void matmul_sub(scalar *c, int ldc, const scalar *a, int lda,
+		       const scalar *b, int ldb, int m, int n, int k);
+
+/* input.c */
+extern void data_open(const char *file);
+extern bool data_streaming(void);
+extern bool data_next(scalar *x, char **name);
+
+/* arena.c */
+extern void *arena_alloc(size_t n);
+extern char *arena_strdup(const char *s);
+extern void arena_release(void);
+
 /* miscellaneous */
 extern node *cons(int, node *, node *);
 extern char *tokdump(int value);
 extern void yyerror(const char *errmsg);
 extern void interpret(node *tree);
-extern int verbose, linewidth, fieldwidth;
+extern bool is_scalar(node *tp);
+extern int verbose, linewidth, fieldwidth, jitlevel;
+extern bool treewalk, optimize, translating, profiling;
+extern char *samplefile;
+
+/* compile.c */
+extern program *compile(node *tree);
+extern void disassemble(program *prog);
 
 /* execute.c */
-extern void execute(node *tree);
+typedef struct binding_t
+{
+    struct binding_t	*next;
+    char		*name;		/* the variable */
+    char		*file;		/* its matrix file */
+    bool		output;		/* save it at the end, not load it? */
+}
+binding;
+
+extern binding *bindings;
+extern void execute(node *tree, program *prog);
+extern void bind_matrix(char *spec, bool output);
+extern void count_bindings(void);
+extern lvar *find_variable(const char *name);
+
+/* translate.c */
+extern void translate(node *tree, program *prog);
+
+/* jit.c */
+extern void jit_start(program *prog);
+extern jitfn jit_code(int entry);
+extern program *jit_reference(int entry);
+extern void jit_finish(void);
+
+/* profile.c */
+extern void profile_start(node *tree);
+extern void profile_statement(node *sp);
+extern void profile_call(node *target);
+extern void profile_return(void);
+extern void profile_report(void);
 
 /* monitor.c */
 extern noreturn void die(char *msg, ...);
@@ -127,18 +307,44 @@ extern void make_scalar(value *v, scalar n);
 extern value copy_value(value);
 extern value allocate_value(int rank, int i, int j);
 extern void deallocate_value(value *);
+extern void unshare_value(value *);
+
+/* kinds of storage that allocations are charged to, for -m */
+typedef enum
+{
+    ALLOC_PARSE,		/* parse trees and symbols */
+    ALLOC_SCALAR,		/* scalar values; these cost no storage */
+    ALLOC_TEMP,			/* vectors and matrices computed */
+    ALLOC_VARIABLE,		/* the variables, and elements changed or loaded */
+    ALLOC_KINDS
+}
+allockind;
+
+extern bool accounting;
+extern void account_alloc(allockind kind, size_t bytes);
+extern void account_free(allockind kind, size_t bytes);
+extern void account_report(void);
 
 void cupl_reset_write(void);
 void cupl_eol_write(void);
+void cupl_flush_write(void);
 void cupl_scalar_write(char *name, scalar quant);
 void cupl_string_write(char *s);
 
+value cupl_load_matrix(const char *file);
+void cupl_save_matrix(const char *file, value v);
+
 extern value cupl_add(value, value);
 extern value cupl_multiply(value, value);
 extern value cupl_subtract(value, value);
 extern value cupl_divide(value, value);
 extern value cupl_power(value, value);
 extern value cupl_uminus(value);
+extern void cupl_add_into(value *, value, value);
+extern void cupl_subtract_into(value *, value, value);
+extern void cupl_divide_into(value *, value, value);
+extern void cupl_uminus_into(value *, value);
+extern void cupl_abs_into(value *, value);
 
 extern value cupl_abs(value);
 extern value cupl_atan(value);
@@ -34,6 +34,11 @@ static int statement_count;
 
 #include "cupl.h"
 
+extern int yylineno;		/* the current source line */
+
+/* a *DATA section parses as one right-recursive list; let it be long */
+#define YYMAXDEPTH	1000000
+
 #ifdef YYBISON
 int yydebug;
 #endif /* YYBISON */
@@ -44,6 +49,7 @@ int yydebug;
 %union
 {
     struct edon	*node;
+    int		line;
 }
 
 /* keywords */
@@ -92,6 +98,7 @@ int yydebug;
 %type <node> prog command cond simple guard perform gosub iter expr rel alloc
 %type <node> subscr datal ditem triple expl readl writel witem allocl varlist
 %type <node> minl maxl
+%type <line> here
 
 %%	/* beginning of rules section */
 
@@ -99,24 +106,30 @@ int yydebug;
 program :    prog			{interpret($1);}
 	;
 
-prog	:    command prog
+prog	:    here command prog
 		{
-		    $$ = cons(STATEMENT, $1, $2);
+		    $$ = cons(STATEMENT, $2, $3);
 #ifdef PARSEDEBUG
 		    $$->number = ++statement_count;
+		    $$->line = $1;
 #endif /* PARSEDEBUG */
 		}
-	|    IDENTIFIER command prog
+	|    here IDENTIFIER command prog
 		{
-		    $$ = cons(STATEMENT, cons(LABEL, $1, $2), $3);
+		    $$ = cons(STATEMENT, cons(LABEL, $2, $3), $4);
 #ifdef PARSEDEBUG
 		    $$->number = ++statement_count;
+		    $$->line = $1;
 #endif /* PARSEDEBUG */
 		}
 	|    /* EMPTY */
 		{$$ = (node *)NULL;}
 	;
 
+/* the line a statement starts on; the parser has read its first token */
+here	:    /* EMPTY */		{$$ = yylineno;}
+	;
+
 /* statement syntax */
 
 command	:    simple			{$$ = $1;}
@@ -301,11 +314,7 @@ node *cons(int op, node *left, node *right)
     node	*new;
 
     /* get a node */
-    if ((new = (node *)malloc(sizeof(node))) == (node *)NULL)
-    {
-	(void) puts(NOMEM);
-	exit(1);
-    }
+    new = (node *)arena_alloc(sizeof(node));
 
     new->type = op;
     new->u.n.left = left;
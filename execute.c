@@ -4,19 +4,31 @@ NAME
    execute.c -- parse-tree execution
 
 SYNOPSIS
-   void execute(node *tree)	-- execute a parse tree
+   void execute(node *tree, program *prog)	-- execute a parse tree
+   void bind_matrix(char *spec, bool output)	-- tie a variable to a file
+   void count_bindings(void)			-- count them as sets and uses
+   lvar *find_variable(const char *name)	-- look up a bound variable
 
 DESCRIPTION 
-   This code does execution of a CUPL parse tree.  It uses the runtime
-support in monitor.c.
+   This code does execution of a CUPL parse tree, either by running the
+bytecode compiled from it or by walking the tree directly with cupl_eval().
+The tree walker is the reference implementation; the -t option selects it.
+Blocks the bytecode PERFORMs often enough are handed to jit.c to be run
+as machine code.  With -p, both tell profile.c as statements and PERFORMs
+start and finish; with -P, only as PERFORMs do.
+Both use the runtime support in monitor.c.
+   bind_matrix() takes a NAME=file specification from the command line.
+Variables bound for input are loaded from their matrix files before the
+program starts, and those bound for output are saved to theirs when it
+stops.
 
 LICENSE
    SPDX-License-Identifier: BSD-2-clause
 *****************************************************************************/
 /*LINTLIBRARY*/
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
-#include <setjmp.h>
 #include <math.h>
 #include "cupl.h"
 #include "tokens.h"
@@ -26,39 +38,37 @@ LICENSE
 #define RETURN_WRAP(t, l, r, v)	display_return(t, l, r, v);
 
 static node *data;	/* pointer to *DATA item to be grabbed next */
-static jmp_buf endbuf;	/* termination handling */
+
+#define STACKSIZE	64	/* PERFORM activations to allow for at first */
 
 /****************************************************************************
  *
- * Stack handling
+ * I/O support
  *
  ****************************************************************************/
 
-#define STACKSIZE	64
-static node *stack[STACKSIZE], **sp = stack;
-
-static node *popstack(void)
-/* pop the perform stack */
+static bool next_datum(scalar *x, char **name)
+/* get the next data item, from the data file or the *DATA list */
 {
-    if (sp <= stack)
-	die("too many END statements\n");
-    return(*--sp);
-}
+    if (data_streaming())
+	return(data_next(x, name));
+    else if (data == (node *)NULL)
+	return(false);
 
-static void pushstack(node *st)
-/* push a return location onto the perform stack */
-{
-    if (sp >= stack + STACKSIZE)
-	die("too many PERFORM calls\n");
-    *sp++ = st;
+    if (data->car->type == NUMBER)
+    {
+	*name = (char *)NULL;
+	*x = data->car->u.numval;
+    }
+    else
+    {
+	*name = data->car->car->u.string;
+	*x = data->car->cdr->u.numval;
+    }
+    data = data->cdr;
+    return(true);
 }
 
-/****************************************************************************
- *
- * I/O support
- *
- ****************************************************************************/
-
 static void cupl_read(node *tp)
 /* evaluate a READ item */
 {
@@ -67,29 +77,23 @@ static void cupl_read(node *tp)
     else
     {
 	/* FIXME: read into subscripted variables and slices won't work */
-	value *v = &(tp->syminf->value);
+	value *v = &VALUE(tp->syminf);
+	scalar	*elements;
+	char	*name;
 	int	n;
 
+	unshare_value(v);
+	elements = ELEMENTS(*v);
+
 	for (n = 0; n < v->width * v->depth; n++)
-	    if (data == (node *)NULL)
+	    if (!next_datum(&elements[n], &name))
 	    {
 		warn("data list too short\n");
-		v->elements[n] = 1;	/* 5-2 */
-	    }
-	    else
-	    {
-		if (data->car->type == NUMBER)
-		    v->elements[n] = data->car->u.numval;
-		else
-		{
-		    if (strcmp(tp->u.string , data->car->car->u.string))
-			warn("data mismatch; expecting %s, saw %s\n",
-			     tp->u.string , data->car->car->u.string);
-		    v->elements[n] = data->car->cdr->u.numval;
-		}
-
-		data = data->cdr;
+		elements[n] = 1;	/* 5-2 */
 	    }
+	    else if (name && strcmp(tp->u.string, name))
+		warn("data mismatch; expecting %s, saw %s\n",
+		     tp->u.string, name);
     }
 }
 
@@ -110,9 +114,117 @@ static void eval_write(node *tp)
     else if (tp->type == STRING)
 	cupl_string_write(tp->u.string);
     else if (tp->type == FWRITE)
-	cupl_scalar_write((char *)NULL, tp->car->syminf->value.elements[0]);
+	cupl_scalar_write((char *)NULL, ELEMENTS(VALUE(tp->car->syminf))[0]);
     else
-	cupl_scalar_write(tp->u.string, tp->syminf->value.elements[0]);
+	cupl_scalar_write(tp->u.string, ELEMENTS(VALUE(tp->syminf))[0]);
+}
+
+static void exec_read(node *tree)
+/* execute a READ statement */
+{
+    node	*np;
+
+    for_cdr(np, tree)
+	cupl_read(np->car);
+}
+
+static void exec_write(node *tree)
+/* execute a WRITE statement */
+{
+    node	*np;
+
+    cupl_reset_write();
+    for_cdr(np, tree)
+	eval_write(np->car);
+    cupl_eol_write();
+}
+
+static void exec_watch(node *tree)
+/* execute a WATCH statement */
+{
+    node	*np;
+
+    for_cdr(np, tree)
+	np->car->syminf->watchcount = 10;
+}
+
+/****************************************************************************
+ *
+ * Matrix file bindings
+ *
+ ****************************************************************************/
+
+binding *bindings;	/* most recent first */
+
+void bind_matrix(char *spec, bool output)
+/* tie a variable to a matrix file, given NAME=file */
+{
+    binding	*bp;
+    char	*eq = strchr(spec, '=');
+
+    if (eq == (char *)NULL || eq == spec || eq[1] == '\0')
+	die("matrix file binding %s should be NAME=file\n", spec);
+    if ((bp = (binding *)malloc(sizeof(binding))) == (binding *)NULL)
+	die(NOMEM);
+    bp->name = spec;
+    *eq = '\0';
+    bp->file = eq + 1;
+    bp->output = output;
+    bp->next = bindings;
+    bindings = bp;
+}
+
+lvar *find_variable(const char *name)
+/* find a program variable by name */
+{
+    lvar	*lp;
+
+    for_symbols(lp)
+	if (strcmp(lp->node->u.string, name) == 0)
+	    return(lp);
+    die("no variable %s in the program\n", name);
+}
+
+void count_bindings(void)
+/* count loads as assignments and saves as uses, for the consistency checks */
+{
+    binding	*bp;
+    lvar	*lp;
+
+    for (bp = bindings; bp; bp = bp->next)
+	if (bp->output)
+	    find_variable(bp->name)->used++;
+	else
+	{
+	    lp = find_variable(bp->name);
+	    lp->assigned++;
+	    lp->matrix = true;	/* and a load can make a variable a matrix */
+	}
+}
+
+static void load_matrices(void)
+/* load the variables bound for input */
+{
+    binding	*bp;
+
+    for (bp = bindings; bp; bp = bp->next)
+	if (!bp->output)
+	{
+	    lvar	*lp = find_variable(bp->name);
+
+	    deallocate_value(&VALUE(lp));
+	    VALUE(lp) = cupl_load_matrix(bp->file);
+	}
+}
+
+static void save_matrices(void)
+/* save the variables bound for output */
+{
+    binding	*bp;
+
+    for (bp = bindings; bp; bp = bp->next)
+	if (bp->output)
+	    cupl_save_matrix(bp->file, VALUE(find_variable(bp->name)));
 }
 
 /****************************************************************************
@@ -137,34 +249,39 @@ static void display_return(node *tree, node *left, node *right, value v)
 	else if (v.rank == FAIL)
 	    (void) printf("no value returned\n");
 	else
-	    (void) printf("returned %f\n", v.elements[0]);
+	    (void) printf("returned %f\n", ELEMENTS(v)[0]);
     }
 }
 
-static void cupl_assign(node *to, value from)
-/* assign result of the expression at the cdr to the identifier at the cdr */
+static void cupl_assign(lvar *to, value from)
+/* assign a value to a variable */
 {
-    value cupl_eval(node *tree);
-
-    deallocate_value(&(to->syminf->value));
-    to->syminf->value = from;
-    if (to->syminf->watchcount && to->syminf->watchcount--)
+    deallocate_value(&VALUE(to));
+    VALUE(to) = from;
+    if (to->watchcount && to->watchcount--)
     {
-	eval_write(to);
+	eval_write(to->node);
 	cupl_eol_write();
     }
 }
 
-value cupl_eval(node *tree)
-/* recursively evaluate a CUPL parse tree */
+value cupl_eval(node *tree);
+
+static scalar eval_scalar(node *tree)
+/* evaluate an expression, returning its first element */
 {
-    node *pc;	/* pointer to statement being evaluated */
-    node *next;	/* the statement node to evaluate next */
-    static jmp_buf nextbuf;	/* end-of-statement handling */
+    value	v = EVAL_WRAP(cupl_eval(tree));
+    scalar	s = ELEMENTS(v)[0];
 
-    value	leftside, rightside, result, cond;
-    node	*np, *iterator;
-    int		n;
+    deallocate_value(&v);
+    return(s);
+}
+
+value cupl_eval(node *tree)
+/* recursively evaluate an expression or simple statement */
+{
+    value	leftside, rightside, result;
+    node	*np;
 
     if (verbose >= DEBUG_EXECUTE)
 	(void) printf("eval begins:  %p (%-10s of %p, %p)\n",
@@ -178,28 +295,24 @@ value cupl_eval(node *tree)
 	return(result);
 
     case IDENTIFIER:
-	result = copy_value(tree->syminf->value);
+	result = copy_value(VALUE(tree->syminf));
 	RETURN_WRAP(tree, tree->car, tree->cdr, result)
 	return(result);
 
     case READ:
-	for_cdr(np, tree)
-	    cupl_read(np->car);
+	exec_read(tree);
 	result.rank = FAIL;
 	RETURN_WRAP(tree, tree->car, tree->cdr, result)
 	return(result);
 
     case WRITE:
-	cupl_reset_write();
-	for_cdr(np, tree)
-	    eval_write(np->car);
-	cupl_eol_write();
+	exec_write(tree);
 	result.rank = FAIL;
 	RETURN_WRAP(tree, tree->car, tree->cdr, result)
 	return(result);
 
     case LET:
-	cupl_assign(tree->car, EVAL_WRAP(cupl_eval(tree->cdr)));
+	cupl_assign(tree->car->syminf, EVAL_WRAP(cupl_eval(tree->cdr)));
 	result.rank = FAIL;
 	RETURN_WRAP(tree, tree->car, tree->cdr, result)
 	return(result);
@@ -211,8 +324,9 @@ value cupl_eval(node *tree)
     case PLUS:
 	leftside = EVAL_WRAP(cupl_eval(tree->car));
 	rightside = EVAL_WRAP(cupl_eval(tree->cdr));
-	result = cupl_add(leftside, rightside);
-	deallocate_value(&leftside); deallocate_value(&rightside);
+	cupl_add_into(&leftside, leftside, rightside);
+	deallocate_value(&rightside);
+	result = leftside;
 	RETURN_WRAP(tree, tree->car, tree->cdr, result)
 	return(result);
 
@@ -227,16 +341,18 @@ value cupl_eval(node *tree)
     case MINUS:
 	leftside = EVAL_WRAP(cupl_eval(tree->car));
 	rightside = EVAL_WRAP(cupl_eval(tree->cdr));
-	result = cupl_subtract(leftside, rightside);
-	deallocate_value(&leftside); deallocate_value(&rightside);
+	cupl_subtract_into(&leftside, leftside, rightside);
+	deallocate_value(&rightside);
+	result = leftside;
 	RETURN_WRAP(tree, tree->car, tree->cdr, result)
 	return(result);
 
     case DIVIDE:
 	leftside = EVAL_WRAP(cupl_eval(tree->car));
 	rightside = EVAL_WRAP(cupl_eval(tree->cdr));
-	result = cupl_divide(leftside, rightside);
-	deallocate_value(&leftside); deallocate_value(&rightside);
+	cupl_divide_into(&leftside, leftside, rightside);
+	deallocate_value(&rightside);
+	result = leftside;
 	RETURN_WRAP(tree, tree->car, tree->cdr, result)
 	return(result);
 
@@ -250,15 +366,15 @@ value cupl_eval(node *tree)
 
     case UMINUS:
 	rightside = EVAL_WRAP(cupl_eval(tree->cdr));
-	result = cupl_uminus(rightside);
-	deallocate_value(&rightside);
+	cupl_uminus_into(&rightside, rightside);
+	result = rightside;
 	RETURN_WRAP(tree, tree->car, tree->cdr, result)
 	return(result);
 
     case ABS:
 	rightside = EVAL_WRAP(cupl_eval(tree->cdr));
-	result = cupl_abs(rightside);
-	deallocate_value(&rightside);
+	cupl_abs_into(&rightside, rightside);
+	result = rightside;
 	RETURN_WRAP(tree, tree->car, tree->cdr, result)
 	return(result);
 
@@ -316,18 +432,28 @@ value cupl_eval(node *tree)
 	return(result);
 
     case MAX:
-	rightside = EVAL_WRAP(cupl_eval(tree->cdr));
-	result = cupl_max(leftside, rightside);
-	deallocate_value(&leftside);
-	deallocate_value(&rightside);
+	result = EVAL_WRAP(cupl_eval(tree->car));
+	for_cdr(np, tree->cdr)
+	{
+	    leftside = result;
+	    rightside = EVAL_WRAP(cupl_eval(np->car));
+	    result = cupl_max(leftside, rightside);
+	    deallocate_value(&leftside);
+	    deallocate_value(&rightside);
+	}
 	RETURN_WRAP(tree, tree->car, tree->cdr, result)
 	return(result);
 
     case MIN:
-	rightside = EVAL_WRAP(cupl_eval(tree->cdr));
-	result = cupl_min(leftside, rightside);
-	deallocate_value(&leftside);
-	deallocate_value(&rightside);
+	result = EVAL_WRAP(cupl_eval(tree->car));
+	for_cdr(np, tree->cdr)
+	{
+	    leftside = result;
+	    rightside = EVAL_WRAP(cupl_eval(np->car));
+	    result = cupl_min(leftside, rightside);
+	    deallocate_value(&leftside);
+	    deallocate_value(&rightside);
+	}
 	RETURN_WRAP(tree, tree->car, tree->cdr, result)
 	return(result);
 
@@ -485,171 +611,701 @@ value cupl_eval(node *tree)
 	die("ALLOCATE is not implemented\n");
 
 	/*
-	 * Control structures.
+	 * Tracing.
 	 */
 
-    case LABEL:
-	(void) cupl_eval(tree->cdr);
-	result.rank = FAIL;
+    case WATCH:
+	exec_watch(tree);
+	result.rank == FAIL;
 	return(result);
 
-    case WHILE:
-	do {
-	    cupl_eval(tree->cdr);
+    default:
+	die("unknown node type %d (%s), cannot execute\n",
+	    tree->type,
+	    tokdump(tree->type));
+	break;
+    }
+}
 
-	    cond = cupl_eval(tree->car);
-	} while
-	    (cond.rank);
-	result.rank = FAIL;
-	return(result);
+/*
+ * The tree walker runs statements itself, keeping an explicit stack of
+ * activations instead of recursing through cupl_eval() for each PERFORM,
+ * so the depth of PERFORM calls is limited only by memory.  A BODY
+ * activation steps through a block's statements; the others are the
+ * loops of PERFORM ... TIMES, WHILE, UNTIL and FOR, each of which pushes
+ * a BODY activation for every pass and decides what to do next when it
+ * is popped.  GO TO moves the innermost BODY along, GO TO ... END pops
+ * it, and STOP abandons the whole stack.
+ */
+#define BODY	0
+
+typedef struct
+{
+    int		kind;		/* BODY, or the type of the loop node */
+    node	*tree;		/* the loop node */
+    node	*pc;		/* BODY: next statement; FOR: next list item */
+    bool	started;	/* has the loop made a pass yet? */
+    bool	counting;	/* FOR: stepping through a triple? */
+    int		n;		/* TIMES: passes left */
+    scalar	ds, final, increment;	/* FOR: counter and limits */
+}
+activation;
 
-    case UNTIL:
-	do {
-	    cupl_eval(tree->cdr);
+static activation *acts;	/* the activation stack */
+static int nacts, maxacts;	/* activations in use and allocated */
 
-	    cond = cupl_eval(tree->car);
-	} while
-	    (!cond.rank);
-	result.rank = FAIL;
-	return(result);
+static activation *push(int kind, node *tree, node *pc)
+/* start a new activation, growing the stack as needed */
+{
+    activation	*ap;
+
+    if (nacts >= maxacts)
+    {
+	maxacts = maxacts ? maxacts * 2 : STACKSIZE;
+	acts = (activation *)realloc(acts, sizeof(activation) * maxacts);
+	if (acts == (activation *)NULL)
+	    die(NOMEM);
+    }
+    ap = &acts[nacts++];
+    ap->kind = kind;
+    ap->tree = tree;
+    ap->pc = pc;
+    ap->started = ap->counting = false;
+    return(ap);
+}
+
+static void set_counter(activation *ap)
+/* store a FOR loop's counter in its variable */
+{
+    lvar	*lp = ap->tree->car->car->syminf;
+
+    unshare_value(&VALUE(lp));
+    ELEMENTS(VALUE(lp))[0] = ap->ds;
+}
+
+static bool resume(activation *ap)
+/* go on with a loop; false if it is finished */
+{
+    node	*tree = ap->tree, *np;
+    value	cond;
+
+    switch (ap->kind)
+    {
+    case TIMES:
+	if (!ap->started)
+	{
+	    ap->n = floor(eval_scalar(tree->car));
+	    ap->started = true;
+	}
+	if (ap->n == 0)
+	    return(false);
+	ap->n--;
+	return(true);
+
+    case WHILE:
+    case UNTIL:
+	/* the test comes after each pass */
+	if (ap->started)
+	{
+	    cond = EVAL_WRAP(cupl_eval(tree->car));
+	    if ((ap->kind == WHILE) != (cond.rank != 0))
+		return(false);
+	}
+	ap->started = true;
+	return(true);
 
     case FOR:
-	iterator = tree->car;
-	if (iterator->type == '=')
+	if (tree->car->type == ITERATE)
+	{
+	    if (!ap->started)
+	    {
+		node	*iterator = tree->car->cdr->cdr;
+
+		ap->ds = eval_scalar(tree->car->cdr->car);
+		ap->final = eval_scalar(iterator->car);
+		ap->increment = iterator->cdr ? eval_scalar(iterator->cdr) : 1;
+		ap->started = true;
+	    }
+	    else
+		ap->ds += ap->increment;
+	    /* as the bytecode does, so a NaN limit ends the loop at once */
+	    if (!(ap->ds <= ap->final))
+		return(false);
+	    set_counter(ap);
+	    return(true);
+	}
+	else if (tree->car->type != '=')
+	    die("unknown iterator in FOR statement\n");
+
+	/* a list of values and triples; pc walks the list */
+	if (!ap->started)
 	{
-	    for_cdr(np, iterator->cdr)
-		if (np->car->type == TRIPLE)
+	    ap->pc = tree->car->cdr;
+	    ap->started = true;
+	}
+	if (ap->counting)
+	{
+	    ap->ds += ap->increment;
+	    if (ap->ds <= ap->final)
+	    {
+		set_counter(ap);
+		return(true);
+	    }
+	    ap->counting = false;
+	}
+	while ((np = ap->pc) != NULLNODE)
+	{
+	    ap->pc = np->cdr;
+	    if (np->car->type == TRIPLE)
+	    {
+		node	*triple = np->car;
+
+		ap->ds = eval_scalar(triple->car);
+		ap->increment = eval_scalar(triple->cdr->car);
+		ap->final = eval_scalar(triple->cdr->cdr);
+		if (ap->ds <= ap->final)
 		{
-		    scalar ds, initial, final, increment;
-		    node	*triple = np->car;
-
-		    initial = EVAL_WRAP(cupl_eval(triple->car)).elements[0];
-		    increment = EVAL_WRAP(cupl_eval(triple->cdr->car)).elements[0];
-		    final = EVAL_WRAP(cupl_eval(triple->cdr->cdr)).elements[0];
-
-		    for (ds = initial; ds <= final; ds += increment)
-		    {
-			tree->car->car->syminf->value.elements[0] = ds;
-			cupl_eval(tree->cdr);
-		    }
+		    ap->counting = true;
+		    set_counter(ap);
+		    return(true);
 		}
-		else
-		{
-		    result = EVAL_WRAP(cupl_eval(np->car));
-		    cupl_assign(iterator->car, result);
-		    cupl_eval(tree->cdr);
-	    	}
+	    }
+	    else
+	    {
+		cupl_assign(tree->car->car->syminf,
+			    EVAL_WRAP(cupl_eval(np->car)));
+		return(true);
+	    }
 	}
-	else if (iterator->type == ITERATE)
-	{
-	    scalar ds, initial, final, increment;
+	return(false);
+
+    default:
+	die("internal error -- bad activation %d\n", ap->kind);
+    }
+}
+
+static bool walk(node *program)
+/* run a program by walking its tree; true if it ended with a STOP */
+{
+    activation	*ap;
+    node	*pc, *tp;
+    value	cond;
+
+    nacts = 0;
+    (void) push(BODY, NULLNODE, program);
 
-	    initial = EVAL_WRAP(cupl_eval(iterator->cdr->car)).elements[0];
-	    iterator = iterator->cdr->cdr;
-	    final = EVAL_WRAP(cupl_eval(iterator->car)).elements[0];
-	    increment = iterator->cdr ? EVAL_WRAP(cupl_eval(iterator->car)).elements[0] : 1;
+    while (nacts > 0)
+    {
+	ap = &acts[nacts - 1];
 
-	    for (ds = initial; ds <= final; ds += increment)
+	/* a loop either makes another pass or is done */
+	if (ap->kind != BODY)
+	{
+	    if (resume(ap))
 	    {
-		tree->car->car->syminf->value.elements[0] = ds;
-		cupl_eval(tree->cdr);
+		if (profiling || samplefile)
+		    profile_call(ap->tree->cdr->car);
+		(void) push(BODY, NULLNODE, ap->tree->cdr->car);
 	    }
+	    else
+		nacts--;
+	    continue;
 	}
-	else
-	    die("unknown iterator in FOR statement\n");
-	result.rank = FAIL;
-	return(result);
-
-    case TIMES:
-	result = cupl_eval(tree->car);
-	for (n = floor(result.elements[0]); n; n--)
-	     (void) cupl_eval(tree->cdr);
-	result.rank = FAIL;
-	return(result);
 
-    case PERFORM:
-	/* now execute the program */
-	for (pc = tree->car; pc; pc = next)
+	/* falling off the end of a block finishes its PERFORM */
+	if ((pc = ap->pc) == NULLNODE)
 	{
-	    if (verbose >= DEBUG_EXECUTE)
-		(void) printf("statement %2d: %p (%-10s of %p, %p)\n",
-		      pc->number, pc, tokdump(pc->type), pc->car, pc->cdr);
+	    nacts--;
+	    if (profiling || samplefile)
+		profile_return();
+	    continue;
+	}
+
+	if (profiling)
+	    profile_statement(pc);
+
+	if (verbose >= DEBUG_EXECUTE)
+	    (void) printf("statement %2d: %p (%-10s of %p, %p)\n",
+		  pc->number, pc, tokdump(pc->type), pc->car, pc->cdr);
 
-	    switch (pc->car->type)
+	ap->pc = pc->cdr;
+	for (tp = pc->car; tp; )
+	    switch (tp->type)
 	    {
 	    case BLOCK:
-		next = pc->endnode->cdr;
+		ap->pc = pc->endnode->cdr;
+		tp = NULLNODE;
+		break;
+
+	    case LABEL:
+		tp = tp->cdr;
+		break;
+
+	    case IF:
+		cond = EVAL_WRAP(cupl_eval(tp->car));
+		tp = cond.rank ? tp->cdr : NULLNODE;
+		break;
+
+	    case IFELSE:
+		cond = EVAL_WRAP(cupl_eval(tp->car));
+		tp = cond.rank ? tp->cdr->car : tp->cdr->cdr;
+		break;
+
+	    case GO:
+		ap->pc = tp->car;
+		tp = NULLNODE;
 		break;
 
 	    case OG:
 		/* FIXME: GOTO END ignores labels */
 	    case END:
-		next = NULLNODE;
+		nacts--;
+		if (profiling || samplefile)
+		    profile_return();
+		tp = NULLNODE;
+		break;
+
+	    case STOP:
+		nacts = 0;
+		return(true);
+
+	    case PERFORM:
+		if (profiling || samplefile)
+		    profile_call(tp->car);
+		(void) push(BODY, NULLNODE, tp->car);
+		tp = NULLNODE;
+		break;
+
+	    case TIMES:
+	    case WHILE:
+	    case UNTIL:
+	    case FOR:
+		(void) push(tp->type, tp, NULLNODE);
+		tp = NULLNODE;
 		break;
 
 	    default:
-		next = pc->cdr;
-		if (setjmp(nextbuf) == 0)
-		    (void) cupl_eval(pc->car);
+		(void) cupl_eval(tp);
+		tp = NULLNODE;
+		break;
+	    }
+    }
+
+    return(false);
+}
+
+/****************************************************************************
+ *
+ * Bytecode execution
+ *
+ ****************************************************************************/
+
+static value *regfile;	/* register windows, one per PERFORM activation */
+static insn **frames;	/* return addresses, one per PERFORM activation */
+static int maxdepth;	/* activations allocated */
+
+#define BINARY(fn)	t = fn(r[pc->a], r[pc->b]); \
+			deallocate_value(&r[pc->a]); \
+			deallocate_value(&r[pc->b]); \
+			r[pc->dst] = t
+#define INPLACE(fn)	fn(&r[pc->a], r[pc->a], r[pc->b]); \
+			deallocate_value(&r[pc->b]); \
+			r[pc->dst] = r[pc->a]
+#define COMPARE(rel)	cond = rel; \
+			deallocate_value(&r[pc->a]); \
+			deallocate_value(&r[pc->b]); \
+			r[pc->dst].rank = cond; \
+			r[pc->dst].elements = (scalar *)NULL
+
+/*
+ * The scalar-only instructions.  Their operands are known to be scalars,
+ * which own no storage, so there is nothing to check or free; the
+ * relations are monitor.c's, specialized to scalars.
+ */
+#define SCALAR(x)	make_scalar(&r[pc->dst], x)
+#define SA		(r[pc->a].number)
+#define SB		(r[pc->b].number)
+#define S_EQ(x, y)	FUZZY_EQUAL(x, y)
+#define S_LE(x, y)	(FUZZY_EQUAL(x, y) || !((x) > (y)))
+#define S_GE(x, y)	(FUZZY_EQUAL(x, y) || !((x) < (y)))
+#define S_LT(x, y)	(S_LE(x, y) && !S_EQ(x, y))
+#define S_GT(x, y)	(S_GE(x, y) && !S_EQ(x, y))
+#define TRUTH(c)	r[pc->dst].rank = (c); \
+			r[pc->dst].elements = (scalar *)NULL
+
+static void scalarize(value *v)
+/* reduce a value to a scalar holding its first element */
+{
+    if (v->rank > 0)
+    {
+	scalar	first = v->elements[0];
+
+	deallocate_value(v);
+	make_scalar(v, first);
+    }
+}
+
+static int run(program *prog, insn *pc, value *r);
+
+static bool same_value(value *a, value *b)
+/* are two values identical, bit for bit? */
+{
+    return(a->rank == b->rank && a->width == b->width && a->depth == b->depth
+	   && a->elements == b->elements
+	   && memcmp(&a->number, &b->number, sizeof(scalar)) == 0);
+}
+
+static int run_native(program *prog, jitfn native, int entry, value *r)
+/* run a block's native code, checking it against the interpreter if asked */
+{
+    program	*ref;
+    value	*window, *shadow;
+    int		n, ran;
+
+    if (jitlevel < 2)
+	return(native(r, frame));
+
+    /*
+     * Run the native code on copies of the frame and the register window,
+     * then the bytecode it was made from on the real ones.  The reference
+     * code leaves at the same places the native code does, so the two
+     * must agree on where they stopped and on every value they left.
+     */
+    memset(r, 0, sizeof(value) * prog->nregs);
+    window = (value *)malloc(sizeof(value) * prog->nregs);
+    shadow = (value *)malloc(sizeof(value) * (nslots ? nslots : 1));
+    if (window == (value *)NULL || shadow == (value *)NULL)
+	die(NOMEM);
+    memcpy(window, r, sizeof(value) * prog->nregs);
+    memcpy(shadow, frame, sizeof(value) * (nslots ? nslots : 1));
+
+    ran = native(window, shadow);
+    ref = jit_reference(entry);
+    n = run(ref, ref->code + entry, r);
+    if (n != ran)
+	die("JIT self-check failed in the block at %d\n", entry);
+    for (n = 0; n < prog->nregs; n++)
+	if (!same_value(&window[n], &r[n]))
+	    die("JIT self-check failed in the block at %d\n", entry);
+    for (n = 0; n < nslots; n++)
+	if (!same_value(&shadow[n], &frame[n]))
+	    die("JIT self-check failed in the block at %d\n", entry);
+
+    free(window);
+    free(shadow);
+    return(ran);
+}
+
+static int run(program *prog, insn *pc, value *r)
+/* run compiled code from pc until it stops, returns, or leaves */
+{
+    value	*fr, t;
+    int		depth = 0, n;
+    bool	cond;
+    jitfn	native;
+
+    for (;;)
+    {
+	switch (pc->op)
+	{
+	case OP_CONST:
+	    make_scalar(&r[pc->dst], pc->tree->u.numval);
+	    break;
+
+	case OP_LOAD:
+	    r[pc->dst] = copy_value(frame[pc->slot]);
+	    break;
+
+	case OP_STORE:
+	    cupl_assign(pc->var, r[pc->a]);
+	    break;
+
+	case OP_ADD:
+	    INPLACE(cupl_add_into);
+	    break;
+
+	case OP_SUBTRACT:
+	    INPLACE(cupl_subtract_into);
+	    break;
+
+	case OP_MULTIPLY:
+	    BINARY(cupl_multiply);
+	    break;
+
+	case OP_DIVIDE:
+	    INPLACE(cupl_divide_into);
+	    break;
+
+	case OP_POWER:
+	    BINARY(cupl_power);
+	    break;
+
+	case OP_FUNC2:
+	    BINARY(pc->f.fn2);
+	    break;
+
+	case OP_UMINUS:
+	    cupl_uminus_into(&r[pc->a], r[pc->a]);
+	    r[pc->dst] = r[pc->a];
+	    break;
+
+	case OP_ABS:
+	    cupl_abs_into(&r[pc->a], r[pc->a]);
+	    r[pc->dst] = r[pc->a];
+	    break;
+
+	case OP_FUNC1:
+	    t = pc->f.fn1(r[pc->a]);
+	    deallocate_value(&r[pc->a]);
+	    r[pc->dst] = t;
+	    break;
+
+	    /* these follow cupl_eval's definitions exactly */
+	case OP_EQ:
+	    COMPARE(cupl_eq(r[pc->a], r[pc->b]));
+	    break;
+
+	case OP_NE:
+	    COMPARE(!cupl_eq(r[pc->a], r[pc->b]));
+	    break;
+
+	case OP_LT:
+	    COMPARE(cupl_lt(r[pc->a], r[pc->b]));
+	    break;
+
+	case OP_GT:
+	    COMPARE(cupl_gt(r[pc->a], r[pc->b]));
+	    break;
+
+	case OP_LE:
+	    COMPARE(!cupl_gt(r[pc->a], r[pc->b]));
+	    break;
+
+	case OP_GE:
+	    COMPARE(!cupl_lt(r[pc->a], r[pc->b]));
+	    break;
+
+	case OP_AND:
+	    r[pc->dst].rank = r[pc->a].rank && r[pc->b].rank;
+	    break;
+
+	case OP_OR:
+	    r[pc->dst].rank = r[pc->a].rank || r[pc->b].rank;
+	    break;
+
+	case OP_JUMP:
+	    pc = prog->code + pc->target;
+	    continue;
+
+	case OP_JUMPT:
+	    if (r[pc->a].rank)
+	    {
+		pc = prog->code + pc->target;
+		continue;
+	    }
+	    break;
+
+	case OP_JUMPF:
+	    if (!r[pc->a].rank)
+	    {
+		pc = prog->code + pc->target;
+		continue;
+	    }
+	    break;
+
+	case OP_CALL:
+	    if (++depth >= maxdepth)
+	    {
+		maxdepth *= 2;
+		regfile = (value *)realloc(regfile,
+				   sizeof(value) * maxdepth * prog->nregs);
+		frames = (insn **)realloc(frames, sizeof(insn *) * maxdepth);
+		if (regfile == (value *)NULL || frames == (insn **)NULL)
+		    die(NOMEM);
+	    }
+	    frames[depth] = pc + 1;
+	    r = regfile + depth * prog->nregs;
+	    if (profiling || samplefile)
+		profile_call(pc->tree);
+	    if (jitlevel && (native = jit_code(pc->target)))
+	    {
+		n = run_native(prog, native, pc->target, r);
+		if (n == RAN_STOP)
+		    return(RAN_STOP);
+		else if (n == RAN_RETURN)
+		{
+		    if (samplefile)
+			profile_return();
+		    pc = frames[depth--];
+		    r = regfile + depth * prog->nregs;
+		}
 		else
-		    next = popstack();
+		    pc = prog->code + n;
+		continue;
+	    }
+	    pc = prog->code + pc->target;
+	    continue;
+
+	case OP_RETURN:
+	    if (depth == 0)
+		return(RAN_RETURN);
+	    if (profiling || samplefile)
+		profile_return();
+	    pc = frames[depth--];
+	    r = regfile + depth * prog->nregs;
+	    continue;
+
+	case OP_STOP:
+	    return(RAN_STOP);
+
+	case OP_EXIT:
+	    return(pc - prog->code);
+
+	case OP_PROFILE:
+	    profile_statement(pc->tree);
+	    break;
+
+	case OP_TIMES:
+	    fr = &r[pc->a];
+	    scalarize(fr);
+	    fr->number = (int)floor(fr->number);
+	    if (fr->number == 0)
+	    {
+		pc = prog->code + pc->target;
+		continue;
+	    }
+	    break;
+
+	case OP_LOOP:
+	    if (--r[pc->a].number != 0)
+	    {
+		pc = prog->code + pc->target;
+		continue;
+	    }
+	    break;
+
+	case OP_FORPREP:
+	    fr = &r[pc->a];
+	    scalarize(&fr[0]);
+	    scalarize(&fr[1]);
+	    scalarize(&fr[2]);
+	    if (fr[0].number <= fr[1].number)
+	    {
+		unshare_value(&frame[pc->slot]);
+		ELEMENTS(frame[pc->slot])[0] = fr[0].number;
 		break;
 	    }
-	}
-	result.rank = FAIL;
-	return(result);
+	    pc = prog->code + pc->target;
+	    continue;
 
-    case GO:
-	pushstack(tree->car);
-	longjmp(nextbuf, 1);
-  
-    case IF:
-	leftside = EVAL_WRAP(cupl_eval(tree->car));
-	if (leftside.rank)
-	    cupl_eval(tree->cdr);
-	result.rank == FAIL;
-	return(result);
+	case OP_FORLOOP:
+	    fr = &r[pc->a];
+	    fr[0].number += fr[2].number;
+	    if (fr[0].number <= fr[1].number)
+	    {
+		unshare_value(&frame[pc->slot]);
+		ELEMENTS(frame[pc->slot])[0] = fr[0].number;
+		pc = prog->code + pc->target;
+		continue;
+	    }
+	    break;
 
-    case IFELSE:
-	leftside = EVAL_WRAP(cupl_eval(tree->car));
-	if (leftside.rank)
-	    cupl_eval(tree->cdr->car);
-	else
-	    cupl_eval(tree->cdr->cdr);
-	result.rank == FAIL;
-	return(result);
+	case OP_READ:
+	    exec_read(pc->tree);
+	    break;
 
-    case STOP:
-	longjmp(endbuf, 1);
-	/* no fall through */
+	case OP_WRITE:
+	    exec_write(pc->tree);
+	    break;
 
-	/*
-	 * Tracing.
-	 */
+	case OP_WATCH:
+	    exec_watch(pc->tree);
+	    break;
 
-    case WATCH:
-	for_cdr(np, tree)
-	    np->car->syminf->watchcount = 10;
-	result.rank == FAIL;
-	return(result);
+	case OP_EVAL:
+	    r[pc->dst] = cupl_eval(pc->tree);
+	    break;
 
-    default:
-	die("unknown node type %d (%s), cannot execute\n",
-	    tree->type,
-	    tokdump(tree->type));
-	break;
+	case OP_SLOAD:
+	    r[pc->dst] = frame[pc->slot];
+	    break;
+
+	case OP_SADD:
+	    SCALAR(SA + SB);
+	    break;
+
+	case OP_SSUBTRACT:
+	    SCALAR(SA - SB);
+	    break;
+
+	case OP_SMULTIPLY:
+	    SCALAR(SA * SB);
+	    break;
+
+	case OP_SDIVIDE:
+	    SCALAR(SA / SB);
+	    break;
+
+	case OP_SPOWER:
+	    SCALAR(pow(SA, SB));
+	    break;
+
+	case OP_SUMINUS:
+	    SCALAR(-SA);
+	    break;
+
+	case OP_SABS:
+	    SCALAR(fabs(SA));
+	    break;
+
+	case OP_SFUNC:
+	    SCALAR(pc->f.sfn(SA));
+	    break;
+
+	case OP_SEQ:
+	    TRUTH(S_EQ(SA, SB));
+	    break;
+
+	case OP_SNE:
+	    TRUTH(!S_EQ(SA, SB));
+	    break;
+
+	case OP_SLT:
+	    TRUTH(S_LT(SA, SB));
+	    break;
+
+	case OP_SGT:
+	    TRUTH(S_GT(SA, SB));
+	    break;
+
+	case OP_SLE:
+	    TRUTH(!S_GT(SA, SB));
+	    break;
+
+	case OP_SGE:
+	    TRUTH(!S_LT(SA, SB));
+	    break;
+
+	default:
+	    die("internal error -- bad opcode %d\n", pc->op);
+	}
+	pc++;
     }
 }
 
-void execute(node *tree)
-/* execute a CUPL program described by a parse tree */
+void execute(node *tree, program *prog)
+/* execute a CUPL program described by a parse tree and its compiled code */
 {
     node	*np, *last;
-    lvar	*lp;
+    int		n;
+    bool	stopped;
 
     /* initially, all variables are scalars with zero values */
-    for_symbols(lp)
-	make_scalar(&lp->value, 0);
+    for (n = 0; n < nslots; n++)
+	make_scalar(&frame[n], 0);
+
+    if (profiling || samplefile)
+	profile_start(tree);
 
     /* locate the data pointer */
     data = last = (node *)NULL;
@@ -667,13 +1323,34 @@ void execute(node *tree)
     if (data && last)
 	last->cdr = cons(END, NULLNODE, NULLNODE);
 
-    /* first, setjmp so we can use STOP to exit */
-    if (setjmp(endbuf) != 0)
-	return;
-    else
-	cupl_eval(cons(PERFORM, tree, NULLNODE));
+    load_matrices();
 
-    warn("program terminated without explicit STOP\n");
+    if (prog)
+    {
+	if (maxdepth == 0)
+	{
+	    maxdepth = STACKSIZE;
+	    frames = (insn **)malloc(sizeof(insn *) * maxdepth);
+	}
+	regfile = (value *)realloc(regfile,
+				   sizeof(value) * maxdepth * prog->nregs);
+	if (regfile == (value *)NULL || frames == (insn **)NULL)
+	    die(NOMEM);
+	if (jitlevel)
+	    jit_start(prog);
+	stopped = (run(prog, prog->code, regfile) == RAN_STOP);
+	if (jitlevel)
+	    jit_finish();
+    }
+    else
+	stopped = walk(tree);
+    if (!stopped)
+	warn("program terminated without explicit STOP\n");
+    if (profiling || samplefile)
+	profile_report();
+
+    cupl_flush_write();
+    save_matrices();
 }
 
 /* execute.c ends here */
@@ -0,0 +1,226 @@
+/*****************************************************************************
+
+NAME
+   input.c -- streaming data source for READ
+
+SYNOPSIS
+   void data_open(const char *file)	-- take READ data from a file
+   bool data_streaming(void)		-- is READ data coming from a file?
+   bool data_next(scalar *x, char **name)	-- get the next data item
+
+DESCRIPTION
+   Normally READ takes its numbers from the *DATA section at the end of
+the program.  With the -d option they come from a separate file instead
+("-" means standard input), read a block at a time and parsed only as
+READ asks for them, so the amount of data is bounded by the disk rather
+than by the parser, and one program can be run over many data sets.
+
+   The file holds the same items as a *DATA section: numbers, or
+NAME = number, separated by commas or white space.  A number may have
+a sign and an exponent introduced by E or e.
+
+   data_next() returns false when the data are used up.  Otherwise it
+leaves the number in x, and in name the item's name, or NULL if it has
+none; the name is good until the next call.  Most numbers are converted
+exactly by a single multiply or divide of their digits by a power of
+ten; the rest are handed to strtod().
+
+LICENSE
+   SPDX-License-Identifier: BSD-2-clause
+
+*****************************************************************************/
+/*LINTLIBRARY*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include "cupl.h"
+
+#define INBUF	65536	/* bytes read at a time */
+#define TOKMAX	512	/* longest name or number */
+
+static FILE *datafp;		/* the data file, if there is one */
+static char inbuf[INBUF];
+static char *pos, *end;		/* unread part of inbuf */
+static int lineno = 1;		/* for error messages */
+
+void data_open(const char *file)
+/* arrange for READ to take its data from a file */
+{
+    if (strcmp(file, "-") == 0)
+	datafp = stdin;
+    else if ((datafp = fopen(file, "r")) == (FILE *)NULL)
+	die("can't open data file %s\n", file);
+    pos = end = inbuf;
+}
+
+bool data_streaming(void)
+/* is READ data coming from a file? */
+{
+    return(datafp != (FILE *)NULL);
+}
+
+static int refill(void)
+/* read the next block, returning its first character or EOF */
+{
+    size_t	n = fread(inbuf, 1, INBUF, datafp);
+
+    if (n == 0)
+	return(EOF);
+    pos = inbuf;
+    end = inbuf + n;
+    return((unsigned char)*pos);
+}
+
+#define PEEK()	(pos < end ? (unsigned char)*pos : refill())
+
+static int token(char *tok, bool (*part)(int))
+/* copy characters accepted by part into tok, returning the length */
+{
+    int		c, n = 0;
+
+    while ((c = PEEK()) != EOF && part(c))
+    {
+	if (n == TOKMAX - 1)
+	    die("data file line %d: item too long\n", lineno);
+	tok[n++] = c;
+	pos++;
+    }
+    tok[n] = '\0';
+    return(n);
+}
+
+static bool namepart(int c)
+{
+    return(isalnum(c));
+}
+
+static bool numberpart(int c)
+{
+    return(isdigit(c) || c == '.' || c == 'E' || c == 'e'
+	   || c == '-' || c == '+');
+}
+
+static int skip(bool commas)
+/* skip white space, and commas if allowed; return the next character */
+{
+    int		c;
+
+    while ((c = PEEK()) != EOF && (isspace(c) || (commas && c == ',')))
+    {
+	if (c == '\n')
+	    lineno++;
+	pos++;
+    }
+    return(c);
+}
+
+/*
+ * Powers of ten up to 10^22 are exact doubles.  A number with no more
+ * than 2^53 in its digits and a decimal exponent in that range is then
+ * one correctly rounded multiply or divide away from its value.
+ */
+static const double exact10[] =
+{
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+static bool convert(const char *s, scalar *x)
+/* convert a number, returning false if it is malformed */
+{
+    const char	*p = s;
+    uint64_t	m = 0;
+    int		digits = 0, scale = 0, exp = 0;
+    bool	negative = false, fast = true, any = false;
+    char	*stop;
+
+    if (*p == '-' || *p == '+')
+	negative = (*p++ == '-');
+    for (; isdigit((unsigned char)*p); p++, any = true)
+	if (m || *p != '0')
+	{
+	    if (++digits > 19)
+		fast = false;
+	    else
+		m = m * 10 + (*p - '0');
+	}
+    if (*p == '.')
+	for (p++; isdigit((unsigned char)*p); p++, any = true)
+	{
+	    if (m == 0 && *p == '0')
+		scale--;
+	    else if (++digits > 19)
+		fast = false;
+	    else
+	    {
+		m = m * 10 + (*p - '0');
+		scale--;
+	    }
+	}
+    if (!any)
+	return(false);
+    if (*p == 'E' || *p == 'e')
+    {
+	bool	eneg = false;
+
+	p++;
+	if (*p == '-' || *p == '+')
+	    eneg = (*p++ == '-');
+	if (!isdigit((unsigned char)*p))
+	    return(false);
+	for (; isdigit((unsigned char)*p); p++)
+	    if (exp < 10000)
+		exp = exp * 10 + (*p - '0');
+	if (eneg)
+	    exp = -exp;
+    }
+    if (*p != '\0')
+	return(false);
+
+    exp += scale;
+    if (fast && m <= (1ULL << 53) && exp >= -22 && exp <= 22)
+    {
+	*x = (exp < 0) ? (double)m / exact10[-exp] : (double)m * exact10[exp];
+	if (negative)
+	    *x = -*x;
+    }
+    else
+	*x = strtod(s, &stop);
+    return(true);
+}
+
+bool data_next(scalar *x, char **name)
+/* get the next item from the data file */
+{
+    static char	label[TOKMAX];
+    char	tok[TOKMAX];
+    int		c;
+
+    *name = (char *)NULL;
+    if ((c = skip(true)) == EOF)
+	return(false);
+
+    if (isalpha(c))
+    {
+	(void) token(label, namepart);
+	if (skip(false) != '=')
+	    die("data file line %d: expected = after %s\n", lineno, label);
+	pos++;
+	(void) skip(false);
+	*name = label;
+    }
+
+    if (token(tok, numberpart) == 0)
+    {
+	if ((c = PEEK()) == EOF)
+	    die("data file line %d: missing number\n", lineno);
+	die("data file line %d: unexpected character %c\n", lineno, c);
+    }
+    if (!convert(tok, x))
+	die("data file line %d: bad number %s\n", lineno, tok);
+    return(true);
+}
+
+/* input.c ends here */
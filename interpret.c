@@ -8,11 +8,23 @@ SYNOPSIS
 
 DESCRIPTION
    This code does interpretation, static checking, and label resolution
-of a CUPL parse tree.  Actual execution is handed off to execute().
+of a CUPL parse tree, and works out which variables are certainly
+scalars, so that the compiler can use scalar-only instructions for them.
+With -O, expressions are then simplified: operations
+on numbers are done once, here, squares of variables become
+multiplications, and operations that leave their operand alone are dropped;
+and expressions in a repeatedly performed block that can't change while
+it runs are computed once, before each PERFORM of it, instead of on every
+pass through it.
+The resolved tree is then compiled to bytecode by compile(), unless the
+tree walker has been selected; actual execution is handed off to execute(),
+or with -c the compiled code is written out as a C program by translate().
 
 NOTE
-   The NOTE: comments describe a few things that will need to be done 
-differently if we get a compiler back end.
+   The NOTE: comments describe a few things that would need to be done 
+differently for a compiler back end working from the tree.  The one we
+have, translate(), works from the compiled bytecode, in which labels
+are already branch targets, so it needs neither.
 
 LICENSE
   SPDX-License-Identifier: BSD-2-clause
@@ -22,9 +34,13 @@ LICENSE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 #include "cupl.h"
 #include "tokens.h"
 
+value	*frame;		/* values of all variables, indexed by slot */
+int	nslots;		/* count of slots in frame */
+
 /* nodetype.h -- macros that describe the semantics of nodes */
 
 /*
@@ -223,6 +239,9 @@ static bool check_errors(node *tree)
     /* mark labels */
     recursive_apply(tree, r_mark_labels);
 
+    /* matrix files named on the command line set and use variables too */
+    count_bindings();
+
     /* map CORC's GO TO <block> to CUPL's GO TO <block> END */
     if (corc)
 	recursive_apply(tree, mung_corc_labels);
@@ -351,11 +370,7 @@ static bool r_label_rewrite(node *tp)
      * NOTE: we must suppress this if we ever do a compiler back end!
      */
     if (tp->car && tp->car->type == LABEL)
-    {
-	node *oldnode = tp->car;
 	tp->car = tp->car->cdr;
-	free(oldnode);
-    }
 
     return(true);
 }
@@ -422,6 +437,549 @@ static void rewrite(node *tree)
     recursive_apply(tree, r_label_rewrite);
 }
 
+static void number_variables(void)
+/* give each variable a slot in one contiguous frame */
+{
+    lvar	*lp;
+
+    nslots = 0;
+    for_symbols(lp)
+	if (lp->blabeldef || lp->blabelref || lp->slabeldef || lp->slabelref)
+	    lp->slot = -1;
+	else
+	    lp->slot = nslots++;
+
+    if ((frame = (value *)calloc(nslots ? nslots : 1, sizeof(value))) == (value *)NULL)
+	die(NOMEM);
+    if (accounting)
+	account_alloc(ALLOC_VARIABLE, sizeof(value) * nslots);
+}
+
+static void release_variables(void)
+/* free variable storage after a run */
+{
+    int	n;
+
+    for (n = 0; n < nslots; n++)
+	deallocate_value(&frame[n]);
+    if (accounting)
+	account_free(ALLOC_VARIABLE, sizeof(value) * nslots);
+    free(frame);
+    frame = (value *)NULL;
+    nslots = 0;
+}
+
+/*
+ * Rank inference.  Every variable starts out as a scalar zero, and READ and
+ * the counting forms of FOR only ever change the elements of what a variable
+ * already holds, so a variable can only come to hold a vector or matrix by
+ * being loaded from a matrix file (count_bindings() marks those), by a LET
+ * of an expression that might yield one, or by a FOR over a list of values
+ * that might include one, which assigns each value whole.  Marking the
+ * targets of such LETs and FORs until nothing changes leaves every variable
+ * still unmarked provably scalar for the whole run.  Shapes are not
+ * tracked; only scalars get special treatment.
+ */
+static bool widened;	/* did the last pass mark another variable? */
+
+bool is_scalar(node *tp)
+/* is an expression's value known to be a scalar? */
+{
+    switch (tp->type)
+    {
+    case NUMBER:
+	return(true);
+
+    case IDENTIFIER:
+	return(!tp->syminf->matrix);
+
+    case PLUS: case MINUS: case MULTIPLY: case DIVIDE: case POWER:
+	return(is_scalar(tp->car) && is_scalar(tp->cdr));
+
+    case UMINUS: case ABS: case INV: case TRN:
+	return(is_scalar(tp->cdr));
+
+    /* these yield scalars or fail */
+    case ATAN: case COS: case EXP: case FLOOR: case LOG: case LN: case SQRT:
+    case RAND: case MAX: case MIN: case DET: case DOT: case POSMAX:
+    case POSMIN: case SGM: case TRC:
+	return(true);
+
+    default:
+	return(false);
+    }
+}
+
+static bool r_widen_ranks(node *tp)
+/* mark the target of a LET or FOR that might not assign a scalar */
+{
+    node	*np;
+
+    if (tp->type == LET && !tp->car->syminf->matrix && !is_scalar(tp->cdr))
+    {
+	tp->car->syminf->matrix = true;
+	widened = true;
+    }
+    else if (tp->type == FOR && tp->car->type == '='
+	     && !tp->car->car->syminf->matrix)
+	for_cdr(np, tp->car->cdr)
+	    if (np->car->type != TRIPLE && !is_scalar(np->car))
+	    {
+		tp->car->car->syminf->matrix = true;
+		widened = true;
+		break;
+	    }
+    return(true);
+}
+
+static void infer_ranks(node *tree)
+/* find the variables that might hold vectors or matrices */
+{
+    lvar	*lp;
+
+    do {
+	widened = false;
+	recursive_apply(tree, r_widen_ranks);
+    } while (widened);
+
+    if (verbose >= DEBUG_CHECKDUMP)
+	for_symbols(lp)
+	    if (lp->matrix)
+		(void) printf("    %8s: may hold a vector or matrix\n",
+			      lp->node->u.string);
+}
+
+/*
+ * Expression simplification.  This runs before label resolution, while the
+ * parse tree is still a tree (apart from shared IDENTIFIER atoms), so it can
+ * recurse freely and rewrite operator nodes in place.  Operations on numbers
+ * are done with the same runtime functions execution would use, so folding
+ * never changes a result.  The rewrites that would be wrong for a vector or
+ * matrix are only done where infer_ranks() has shown the operand is a scalar.
+ */
+#define CONSTANT(n)	((n) && (n)->type == NUMBER)
+#define IS(n, x)	(CONSTANT(n) && (n)->u.numval == (x))
+
+static node *number(node *tp, value v)
+/* turn an operator node into a NUMBER holding a scalar result */
+{
+    tp->type = NUMBER;
+    tp->u.numval = v.number;
+    return(tp);
+}
+
+static node *fold(node *tp)
+/* simplify an expression, returning its replacement */
+{
+    node	*np, *left, *right;
+    value	l, r, v;
+
+    if (tp == (node *)NULL || ATOMIC(tp->type))
+	return(tp);
+
+    /* the arguments of MAX and MIN are chained through nodes of that type */
+    if (tp->type == MAX || tp->type == MIN)
+    {
+	bool	constant;
+
+	constant = CONSTANT(tp->car = fold(tp->car));
+	for_cdr(np, tp->cdr)
+	    constant = CONSTANT(np->car = fold(np->car)) && constant;
+	if (!constant)
+	    return(tp);
+
+	make_scalar(&v, tp->car->u.numval);
+	for_cdr(np, tp->cdr)
+	{
+	    make_scalar(&r, np->car->u.numval);
+	    v = (tp->type == MAX) ? cupl_max(v, r) : cupl_min(v, r);
+	}
+	return(number(tp, v));
+    }
+
+    left = tp->car = fold(tp->car);
+    right = tp->cdr = fold(tp->cdr);
+
+    /* operations on numbers; all of these are scalar and can't fail */
+    if (CONSTANT(right) && (left == NULLNODE || CONSTANT(left)))
+    {
+	if (left)
+	    make_scalar(&l, left->u.numval);
+	make_scalar(&r, right->u.numval);
+
+	switch (tp->type)
+	{
+	case PLUS:	return(number(tp, cupl_add(l, r)));
+	case MINUS:	return(number(tp, cupl_subtract(l, r)));
+	case MULTIPLY:	return(number(tp, cupl_multiply(l, r)));
+	case POWER:	return(number(tp, cupl_power(l, r)));
+	case UMINUS:	return(number(tp, cupl_uminus(r)));
+	case ABS:	return(number(tp, cupl_abs(r)));
+	case ATAN:	return(number(tp, cupl_atan(r)));
+	case COS:	return(number(tp, cupl_cos(r)));
+	case EXP:	return(number(tp, cupl_exp(r)));
+	case FLOOR:	return(number(tp, cupl_floor(r)));
+	case LOG:	return(number(tp, cupl_log(r)));
+	case LN:	return(number(tp, cupl_ln(r)));
+	case SQRT:	return(number(tp, cupl_sqrt(r)));
+
+	case DIVIDE:
+	    make_scalar(&v, 0);
+	    cupl_divide_into(&v, l, r);
+	    return(number(tp, v));
+	}
+    }
+
+    /*
+     * Identities.  X + 0 is left alone because it turns -0 into 0, which
+     * WRITE would show; X - 0 is only dropped for a positive zero.
+     */
+    switch (tp->type)
+    {
+    case UMINUS:	/* negation just flips signs, whatever the rank */
+	if (right->type == UMINUS)
+	    return(right->cdr);
+	break;
+
+    case DIVIDE:	/* and division by a scalar is elementwise */
+	if (IS(right, 1))
+	    return(left);
+	break;
+
+    case MULTIPLY:
+	if (IS(right, 1) && is_scalar(left))
+	    return(left);
+	if (IS(left, 1) && is_scalar(right))
+	    return(right);
+	break;
+
+    case MINUS:
+	if (IS(right, 0) && !signbit(right->u.numval) && is_scalar(left))
+	    return(left);
+	break;
+
+    case POWER:
+	if (IS(right, 1) && is_scalar(left))
+	    return(left);
+
+	/* X ** 2 is exactly X * X; higher powers could differ in the last bit */
+	if (left->type == IDENTIFIER && is_scalar(left) && IS(right, 2))
+	    return(cons(MULTIPLY, left, left));
+	break;
+    }
+
+    return(tp);
+}
+
+static void simplify(node *tree)
+/* simplify the expressions in every statement */
+{
+    node	*np;
+
+    /* *DATA holds only numbers, and may be far too long to recurse down */
+    for_cdr(np, tree)
+	if (np->car == NULLNODE || np->car->type != DATA)
+	    np->car = fold(np->car);
+}
+
+/*
+ * Loop-invariant code motion.  A block's activation runs its own statements,
+ * the blocks they perform, and for a PERFORM ... FOR the loop's control
+ * variable changes between passes.  An expression that uses only variables
+ * none of these set has the same value throughout an activation, so it can
+ * be computed into a hidden variable at each PERFORM of the block and the
+ * variable used in its place.  This is only done for blocks that contain no
+ * other block (so their statements only ever run as part of them), that no
+ * GO TO enters or leaves, and that are performed repeatedly somewhere.
+ * Hoisted expressions are computed even when the loop doesn't run, so they
+ * are limited to scalar arithmetic and the scalar special functions, which
+ * can neither fail nor have side effects, on variables known to be scalars.
+ * Like simplify(), this works on the tree before label
+ * resolution; variables are given provisional numbers in their slot fields,
+ * which number_variables() replaces.
+ */
+typedef struct
+{
+    int		from, to;	/* positions of the BLOCK and END statements */
+    bool	*sets;		/* variables an activation may set, by number */
+    bool	leaf;		/* contains no other block? */
+    bool	closed;		/* no GO TO crosses its boundary? */
+    bool	loops;		/* performed repeatedly somewhere? */
+    node	*lets;		/* STATEMENT chain computing its hoisted values */
+}
+region;
+
+static region	*regions;	/* the program's blocks */
+static int	nregions;
+static bool	*calls;		/* calls[i * nregions + j]: block i performs j */
+static int	*blockof;	/* region of each block label, by number */
+static int	*where;		/* position of each statement label, by number */
+static int	nvars;		/* count of numbered symbols */
+
+#define NUMBER_OF(np)	((np)->syminf->slot)
+#define INSIDE(rp, n)	((rp)->from < (n) && (n) < (rp)->to)
+#define SITE(n)		((n) == TIMES || (n) == WHILE || (n) == UNTIL || (n) == FOR)
+
+static node *body(node *sp)
+/* the command of a statement, past its label if any */
+{
+    return((sp->car->type == LABEL) ? sp->car->cdr : sp->car);
+}
+
+static void scan(node *tp, int at)
+/* note what a command at a given position sets, performs, and jumps to */
+{
+    region	*rp;
+
+    if (tp == (node *)NULL || ATOMIC(tp->type))
+	return;
+
+    for (rp = regions; rp < regions + nregions; rp++)
+	switch (tp->type)
+	{
+	case LET:
+	case READ:
+	    if (INSIDE(rp, at))
+		rp->sets[NUMBER_OF(tp->car)] = true;
+	    break;
+
+	case FOR:
+	    if (INSIDE(rp, at))
+		rp->sets[NUMBER_OF(tp->car->car)] = true;
+	    break;
+
+	case PERFORM:
+	    if (INSIDE(rp, at))
+		calls[(rp - regions) * nregions + blockof[NUMBER_OF(tp->car)]] = true;
+	    break;
+
+	case GO:
+	    if (INSIDE(rp, at) != INSIDE(rp, where[NUMBER_OF(tp->car)]))
+		rp->closed = false;
+	    break;
+	}
+
+    /* a block performed by a loop runs repeatedly, and FOR sets a variable */
+    if (SITE(tp->type))
+    {
+	rp = &regions[blockof[NUMBER_OF(tp->cdr->car)]];
+	rp->loops = true;
+	if (tp->type == FOR)
+	    rp->sets[NUMBER_OF(tp->car->car)] = true;
+    }
+
+    scan(tp->car, at);
+    scan(tp->cdr, at);
+}
+
+static bool invariant(node *tp, const bool *sets)
+/* is this a pure scalar expression of variables outside sets? */
+{
+    node	*np;
+
+    if (tp == (node *)NULL)
+	return(true);
+
+    switch (tp->type)
+    {
+    case NUMBER:
+	return(true);
+
+    case IDENTIFIER:
+	return(!sets[NUMBER_OF(tp)] && !tp->syminf->matrix);
+
+    case MAX:
+    case MIN:
+	for_cdr(np, tp->cdr)
+	    if (!invariant(np->car, sets))
+		return(false);
+	return(invariant(tp->car, sets));
+
+    case PLUS: case MINUS: case MULTIPLY: case DIVIDE: case POWER:
+    case UMINUS: case ABS: case ATAN: case COS: case EXP: case FLOOR:
+    case LOG: case LN: case SQRT:
+	return(invariant(tp->car, sets) && invariant(tp->cdr, sets));
+
+    default:
+	return(false);
+    }
+}
+
+static node *temporary(void)
+/* make a hidden variable to hold a hoisted value */
+{
+    static int	ntemps;
+    char	name[16];
+    node	*np = (node *)arena_alloc(sizeof(node));
+    lvar	*lp = (lvar *)arena_alloc(sizeof(lvar));
+
+    /* no CUPL identifier can look like this */
+    (void) snprintf(name, sizeof(name), "$%d", ++ntemps);
+    np->type = IDENTIFIER;
+    np->u.string = arena_strdup(name);
+    np->syminf = lp;
+    lp->node = np;
+    lp->next = idlist;
+    idlist = lp;
+    return(np);
+}
+
+static node *hoist(node *tp, region *rp)
+/* replace the invariant parts of a command, returning its replacement */
+{
+    node	*np;
+
+    if (tp == (node *)NULL || ATOMIC(tp->type))
+	return(tp);
+
+    if (invariant(tp, rp->sets))
+    {
+	np = temporary();
+	rp->lets = cons(STATEMENT, cons(LET, np, tp), rp->lets);
+	return(np);
+    }
+
+    if (tp->type == MAX || tp->type == MIN)
+    {
+	tp->car = hoist(tp->car, rp);
+	for_cdr(np, tp->cdr)
+	    np->car = hoist(np->car, rp);
+    }
+    else
+    {
+	tp->car = hoist(tp->car, rp);
+	tp->cdr = hoist(tp->cdr, rp);
+    }
+    return(tp);
+}
+
+static void precede(node *sp, node *lets)
+/* make a statement compute hoisted values before doing its command */
+{
+    node	**slot = (sp->car->type == LABEL) ? &sp->car->cdr : &sp->car;
+    node	*command = *slot, *np, *last = sp;
+
+    /* the statement itself does the first, so jumps to it still do all */
+    *slot = lets->car;
+    for_cdr(np, lets->cdr)
+    {
+	last = last->cdr = cons(STATEMENT, np->car, last->cdr);
+#ifdef PARSEDEBUG
+	last->number = sp->number;
+	last->line = sp->line;
+#endif /* PARSEDEBUG */
+    }
+    last->cdr = cons(STATEMENT, command, last->cdr);
+#ifdef PARSEDEBUG
+    last->cdr->number = sp->number;
+    last->cdr->line = sp->line;
+#endif /* PARSEDEBUG */
+}
+
+static void move_invariants(node *tree)
+/* hoist invariant expressions out of repeatedly performed blocks */
+{
+    node	**stmts, *np, *cp;
+    lvar	*lp;
+    region	*rp;
+    int		nstmts = 0, i, j, v;
+    bool	changed;
+
+    /* number the variables and statements */
+    nvars = 0;
+    for_symbols(lp)
+	lp->slot = nvars++;
+    for_cdr(np, tree)
+	nstmts++;
+    if ((stmts = (node **)malloc(sizeof(node *) * (nstmts + 1))) == (node **)NULL
+	|| (blockof = (int *)calloc(nvars + 1, sizeof(int))) == (int *)NULL
+	|| (where = (int *)calloc(nvars + 1, sizeof(int))) == (int *)NULL
+	|| (regions = (region *)calloc(nstmts + 1, sizeof(region))) == (region *)NULL)
+	die(NOMEM);
+    i = 0;
+    for_cdr(np, tree)
+	stmts[i++] = np;
+
+    /* find the blocks and statement labels */
+    nregions = 0;
+    for (i = 0; i < nstmts; i++)
+    {
+	if ((np = stmts[i]->car)->type != LABEL || np->cdr->type == END)
+	    continue;
+	if (np->cdr->type != BLOCK)
+	{
+	    where[NUMBER_OF(np->car)] = i;
+	    continue;
+	}
+	for (j = i + 1; j < nstmts; j++)
+	    if ((cp = stmts[j]->car)->type == LABEL && cp->cdr->type == END
+			&& cp->car == np->car)
+		break;
+	if (j == nstmts)
+	    goto done;		/* rewrite() will complain about this */
+	rp = &regions[nregions];
+	rp->from = i;
+	rp->to = j;
+	rp->leaf = rp->closed = true;
+	if ((rp->sets = (bool *)calloc(nvars + 1, sizeof(bool))) == (bool *)NULL)
+	    die(NOMEM);
+	blockof[NUMBER_OF(np->car)] = nregions++;
+    }
+    if ((calls = (bool *)calloc(nregions * nregions + 1, sizeof(bool))) == (bool *)NULL)
+	die(NOMEM);
+
+    /* find out what each block's own statements do */
+    for (rp = regions; rp < regions + nregions; rp++)
+	for (i = rp->from + 1; i < rp->to; i++)
+	    if (body(stmts[i])->type == BLOCK)
+		rp->leaf = false;
+    for (i = 0; i < nstmts; i++)
+	scan(stmts[i]->car, i);
+
+    /* and add in what the blocks they perform do */
+    do {
+	changed = false;
+	for (i = 0; i < nregions; i++)
+	    for (j = 0; j < nregions; j++)
+		if (calls[i * nregions + j])
+		{
+		    for (v = 0; v < nvars; v++)
+			if (regions[j].sets[v] && !regions[i].sets[v])
+			    regions[i].sets[v] = changed = true;
+		    if (!regions[j].closed && regions[i].closed)
+		    {
+			regions[i].closed = false;
+			changed = true;
+		    }
+		}
+    } while (changed);
+
+    /* hoist what we can out of each block */
+    for (rp = regions; rp < regions + nregions; rp++)
+	if (rp->leaf && rp->closed && rp->loops)
+	    for (i = rp->from + 1; i < rp->to; i++)
+		stmts[i]->car = hoist(stmts[i]->car, rp);
+
+    /* and compute it before every PERFORM of the block */
+    for (i = 0; i < nstmts; i++)
+    {
+	np = body(stmts[i]);
+	if (SITE(np->type))
+	    np = np->cdr;
+	if (np->type == PERFORM && (rp = &regions[blockof[NUMBER_OF(np->car)]])->lets)
+	    precede(stmts[i], rp->lets);
+    }
+
+done:
+    for (rp = regions; rp < regions + nregions; rp++)
+	free(rp->sets);
+    free(regions);
+    free(calls);
+    free(blockof);
+    free(where);
+    free(stmts);
+}
+
 void interpret(node *tree)
 /* interpret a program parse tree */
 {
@@ -445,14 +1003,43 @@ void interpret(node *tree)
 
     if (check_errors(tree))
 	return;
+    infer_ranks(tree);
+    if (optimize)
+    {
+	simplify(tree);
+	move_invariants(tree);
+    }
     rewrite(tree);
+    number_variables();
 
 #ifdef PARSEDEBUG
     if (verbose >= DEBUG_PARSEDUMP)
 	prettyprint(tree, 0);
 #endif /* PARSEDEBUG */
 
-    execute(tree);
+    /* -c writes the compiled code out as C instead of running it */
+    if (translating)
+    {
+	program	*prog = compile(tree);
+
+	translate(tree, prog);
+	free(prog->code);
+	free(prog);
+    }
+    /* execution traces are of tree nodes, so they need the tree walker */
+    else if (treewalk || verbose >= DEBUG_EXECUTE)
+	execute(tree, (program *)NULL);
+    else
+    {
+	program	*prog = compile(tree);
+
+	if (verbose >= DEBUG_CHECKDUMP)
+	    disassemble(prog);
+	execute(tree, prog);
+	free(prog->code);
+	free(prog);
+    }
+    release_variables();
 }
 
 /* interpret.c ends here */
@@ -0,0 +1,666 @@
+/*****************************************************************************
+
+NAME
+   jit.c -- native code for hot scalar blocks
+
+SYNOPSIS
+   void jit_start(program *prog)	-- get ready to run a program
+   jitfn jit_code(int entry)		-- native code for a PERFORMed block
+   program *jit_reference(int entry)	-- the same block, for checking
+   void jit_finish(void)		-- release all native code
+
+DESCRIPTION
+   On x86-64 machines, once a block has been PERFORMed JIT_HOT times,
+the bytecode at its entry is compiled to machine code in memory mapped
+executable, and later PERFORMs of it call that instead of interpreting.
+Only the scalar-only instructions (see is_scalar()) are compiled, along
+with constants, stores to scalar variables nothing WATCHes, the logical
+connectives and branches.  The native code starts at the block's entry
+and runs until control reaches a RETURN, a STOP, or an instruction it
+does not handle, such as one involving a matrix, a READ or WRITE, or a
+further PERFORM; it then returns RAN_RETURN, RAN_STOP or the index of
+that instruction, and the bytecode interpreter carries on from there.
+A block whose first instruction can't be compiled is left alone.
+
+   The native code takes the activation's registers and the frame of
+variables and works on them in place, so on every exit they are just as
+the interpreter would have left them.  It keeps nothing in machine
+registers between instructions; a scalar result costs a single store
+once an earlier result in the same register has laid down the
+rank-0 header, which is tracked instruction by instruction.
+
+   jit_reference() gives a copy of the program in which each way out of
+a compiled block is replaced by OP_EXIT, so that the interpreter can run
+the block the same distance for comparison.  The -J option sets jitlevel:
+0 turns the compiler off, 1 (the default) enables it, and 2 compiles
+every block at its first PERFORM and checks each call of native code
+against the interpreter.
+
+LICENSE
+   SPDX-License-Identifier: BSD-2-clause
+
+*****************************************************************************/
+/*LINTLIBRARY*/
+#define _DEFAULT_SOURCE		/* for MAP_ANONYMOUS */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include "cupl.h"
+
+#if defined(__x86_64__) && (defined(__linux__) || defined(__FreeBSD__))
+#include <sys/mman.h>
+#define HAVE_JIT
+#endif /* defined(__x86_64__) && ... */
+
+#define JIT_HOT	16	/* PERFORMs before a block is compiled */
+
+typedef struct
+{
+    jitfn	code;		/* native code, if compiled */
+    size_t	size;		/* bytes mapped for it */
+    program	*reference;	/* code with exits marked, at -J2 */
+    int		calls;		/* PERFORMs so far */
+    bool	failed;		/* not worth compiling? */
+}
+block;
+
+static program *prog;	/* program being run */
+static block *blocks;	/* per entry point, indexed by instruction */
+static bool *watched;	/* variables a WATCH names, by slot */
+
+#ifdef HAVE_JIT
+/****************************************************************************
+ *
+ * Machine code emission
+ *
+ ****************************************************************************/
+
+/* machine registers */
+#define RAX	0
+#define RCX	1
+#define RBX	3	/* the activation's registers */
+#define RBP	5	/* the frame of variables */
+
+/* operand addresses */
+#define REG(n, f)	((int32_t)((n) * sizeof(value) + offsetof(value, f)))
+#define VAR(n, f)	REG(n, f)	/* the frame is an array of values too */
+
+#define MAXINSN	128	/* longest expansion of an instruction is 92 */
+#define EXTRA	32	/* prologue and epilogue */
+
+static unsigned char *out;	/* code being generated */
+static int len;			/* bytes of it so far */
+
+static void bytes(int n, ...)
+/* append some bytes */
+{
+    va_list	ap;
+
+    va_start(ap, n);
+    while (n--)
+	out[len++] = (unsigned char)va_arg(ap, int);
+    va_end(ap);
+}
+
+static void dword(int32_t n)
+/* append a little-endian 32-bit number */
+{
+    memcpy(out + len, &n, sizeof(n));
+    len += sizeof(n);
+}
+
+static void qword(uint64_t n)
+/* append a little-endian 64-bit number */
+{
+    memcpy(out + len, &n, sizeof(n));
+    len += sizeof(n);
+}
+
+static void modrm(int reg, int base, int32_t disp)
+/* address [base + disp32] with the given reg field */
+{
+    bytes(1, 0x80 | (reg & 7) << 3 | base);
+    dword(disp);
+}
+
+static void movsd_load(int xmm, int base, int32_t disp)
+/* movsd xmm, [base + disp] */
+{
+    bytes(3, 0xF2, 0x0F, 0x10);
+    modrm(xmm, base, disp);
+}
+
+static void movsd_store(int base, int32_t disp, int xmm)
+/* movsd [base + disp], xmm */
+{
+    bytes(3, 0xF2, 0x0F, 0x11);
+    modrm(xmm, base, disp);
+}
+
+static void store_imm(int base, int32_t disp, int32_t n, bool wide)
+/* mov dword or qword [base + disp], n */
+{
+    if (wide)
+	bytes(1, 0x48);
+    bytes(1, 0xC7);
+    modrm(0, base, disp);
+    dword(n);
+}
+
+static void call(void *fn)
+/* call an absolute address through rax */
+{
+    bytes(2, 0x48, 0xB8);		/* mov rax, imm64 */
+    qword((uint64_t)(uintptr_t)fn);
+    bytes(2, 0xFF, 0xD0);		/* call rax */
+}
+
+static void sign(int ext)
+/* flip (ext 7) or clear (ext 6) the sign of xmm0 */
+{
+    bytes(5, 0x66, 0x48, 0x0F, 0x7E, 0xC0);	/* movq rax, xmm0 */
+    bytes(5, 0x48, 0x0F, 0xBA, 0xC0 | ext << 3, 63);	/* btc/btr rax, 63 */
+    bytes(5, 0x66, 0x48, 0x0F, 0x6E, 0xC0);	/* movq xmm0, rax */
+}
+
+static void result(int dst, uint64_t known)
+/* store xmm0 as a scalar, laying down the header if it isn't there */
+{
+    movsd_store(RBX, REG(dst, number), 0);
+    if (dst >= 64 || !(known & (1ULL << dst)))
+    {
+	store_imm(RBX, REG(dst, rank), 0, false);
+	store_imm(RBX, REG(dst, width), 1, false);
+	store_imm(RBX, REG(dst, depth), 1, false);
+	store_imm(RBX, REG(dst, elements), 0, true);
+    }
+}
+
+static void truth(int dst)
+/* store the truth value in al, as TRUTH() in execute.c does */
+{
+    bytes(3, 0x0F, 0xB6, 0xC0);		/* movzx eax, al */
+    bytes(1, 0x89);			/* mov [rbx + rank], eax */
+    modrm(RAX, RBX, REG(dst, rank));
+    store_imm(RBX, REG(dst, elements), 0, true);
+}
+
+static void compare(insn *ip)
+/* a scalar relation, computed as S_EQ() and friends are */
+{
+    scalar	fuzz = FUZZ;
+    uint64_t	bits;
+
+    memcpy(&bits, &fuzz, sizeof(bits));
+    movsd_load(0, RBX, REG(ip->a, number));
+    movsd_load(1, RBX, REG(ip->b, number));
+
+    /* al = |a - b| < FUZZ, false for NaNs */
+    bytes(4, 0x66, 0x0F, 0x28, 0xD0);		/* movapd xmm2, xmm0 */
+    bytes(4, 0xF2, 0x0F, 0x5C, 0xD1);		/* subsd xmm2, xmm1 */
+    bytes(5, 0x66, 0x48, 0x0F, 0x7E, 0xD0);	/* movq rax, xmm2 */
+    bytes(5, 0x48, 0x0F, 0xBA, 0xF0, 63);	/* btr rax, 63 */
+    bytes(5, 0x66, 0x48, 0x0F, 0x6E, 0xD0);	/* movq xmm2, rax */
+    bytes(2, 0x48, 0xB8);			/* mov rax, FUZZ */
+    qword(bits);
+    bytes(5, 0x66, 0x48, 0x0F, 0x6E, 0xD8);	/* movq xmm3, rax */
+    bytes(4, 0x66, 0x0F, 0x2E, 0xDA);		/* ucomisd xmm3, xmm2 */
+    bytes(3, 0x0F, 0x97, 0xC0);			/* seta al */
+
+    /* cl = a > b or a < b, false for NaNs */
+    if (ip->op == OP_SLT || ip->op == OP_SGE)
+	bytes(4, 0x66, 0x0F, 0x2E, 0xC1);	/* ucomisd xmm0, xmm1 */
+    else if (ip->op == OP_SGT || ip->op == OP_SLE)
+	bytes(4, 0x66, 0x0F, 0x2E, 0xC8);	/* ucomisd xmm1, xmm0 */
+    if (ip->op != OP_SEQ && ip->op != OP_SNE)
+	bytes(3, 0x0F, 0x97, 0xC1);		/* seta cl */
+
+    switch (ip->op)
+    {
+    case OP_SEQ:		/* S_EQ */
+	break;
+    case OP_SNE:		/* !S_EQ */
+	bytes(2, 0x34, 0x01);			/* xor al, 1 */
+	break;
+    case OP_SLT:		/* !S_EQ && !(a > b) */
+    case OP_SGT:		/* !S_EQ && !(a < b) */
+	bytes(2, 0x08, 0xC8);			/* or al, cl */
+	bytes(2, 0x34, 0x01);			/* xor al, 1 */
+	break;
+    default:			/* S_EQ || a < b, S_EQ || a > b */
+	bytes(2, 0x08, 0xC8);			/* or al, cl */
+	break;
+    }
+    truth(ip->dst);
+}
+
+static void connective(insn *ip)
+/* AND or OR of two truth values */
+{
+    bytes(1, 0x8B);				/* mov eax, [rbx + a.rank] */
+    modrm(RAX, RBX, REG(ip->a, rank));
+    bytes(1, 0x8B);				/* mov ecx, [rbx + b.rank] */
+    modrm(RCX, RBX, REG(ip->b, rank));
+    bytes(2, 0x85, 0xC0);			/* test eax, eax */
+    bytes(3, 0x0F, 0x95, 0xC0);			/* setne al */
+    bytes(2, 0x85, 0xC9);			/* test ecx, ecx */
+    bytes(3, 0x0F, 0x95, 0xC1);			/* setne cl */
+    bytes(2, ip->op == OP_AND ? 0x20 : 0x08, 0xC8);	/* and/or al, cl */
+    bytes(3, 0x0F, 0xB6, 0xC0);			/* movzx eax, al */
+    bytes(1, 0x89);				/* mov [rbx + dst.rank], eax */
+    modrm(RAX, RBX, REG(ip->dst, rank));
+}
+
+/****************************************************************************
+ *
+ * Block compilation
+ *
+ ****************************************************************************/
+
+static bool compilable(insn *ip)
+/* can this instruction be compiled? */
+{
+    switch (ip->op)
+    {
+    case OP_CONST: case OP_SLOAD:
+    case OP_SADD: case OP_SSUBTRACT: case OP_SMULTIPLY: case OP_SDIVIDE:
+    case OP_SPOWER: case OP_SUMINUS: case OP_SABS: case OP_SFUNC:
+    case OP_SEQ: case OP_SNE: case OP_SLT: case OP_SGT: case OP_SLE: case OP_SGE:
+    case OP_AND: case OP_OR:
+    case OP_JUMP: case OP_JUMPT: case OP_JUMPF:
+    case OP_RETURN: case OP_STOP:
+	return(true);
+
+    case OP_STORE:
+	/* a scalar variable has its header already; a watched one needs I/O */
+	return(!ip->var->matrix && !watched[ip->slot]);
+
+    default:
+	return(false);
+    }
+}
+
+static bool falls_through(insn *ip)
+/* may control go on to the next instruction? */
+{
+    return(ip->op != OP_JUMP && ip->op != OP_RETURN && ip->op != OP_STOP);
+}
+
+static bool branches(insn *ip)
+/* does the instruction have a branch target? */
+{
+    return(ip->op == OP_JUMP || ip->op == OP_JUMPT || ip->op == OP_JUMPF);
+}
+
+static bool *reach(int entry)
+/* mark the instructions control can get to from entry without leaving */
+{
+    bool	*seen;
+    int		*stack, top = 0, n;
+
+    seen = (bool *)calloc(prog->ninsns, sizeof(bool));
+    stack = (int *)malloc(sizeof(int) * (prog->ninsns + 1));
+    if (seen == (bool *)NULL || stack == (int *)NULL)
+	die(NOMEM);
+
+    seen[entry] = true;
+    stack[top++] = entry;
+    while (top > 0)
+    {
+	insn	*ip = prog->code + (n = stack[--top]);
+
+	if (!compilable(ip))
+	    continue;
+	if (falls_through(ip) && n + 1 < prog->ninsns && !seen[n + 1])
+	{
+	    seen[n + 1] = true;
+	    stack[top++] = n + 1;
+	}
+	if (branches(ip) && !seen[ip->target])
+	{
+	    seen[ip->target] = true;
+	    stack[top++] = ip->target;
+	}
+    }
+
+    free(stack);
+    return(seen);
+}
+
+static program *reference(bool *seen)
+/* copy the program, turning each way out of the block into OP_EXIT */
+{
+    program	*copy;
+    int		n;
+
+    if ((copy = (program *)malloc(sizeof(program))) == (program *)NULL
+	|| (copy->code = (insn *)malloc(sizeof(insn) * prog->ninsns)) == (insn *)NULL)
+	die(NOMEM);
+    copy->ninsns = prog->ninsns;
+    copy->nregs = prog->nregs;
+    memcpy(copy->code, prog->code, sizeof(insn) * prog->ninsns);
+    for (n = 0; n < prog->ninsns; n++)
+	if (seen[n] && !compilable(prog->code + n))
+	    copy->code[n].op = OP_EXIT;
+    return(copy);
+}
+
+static uint64_t *headers(int entry, bool *seen)
+/*
+ * For each instruction, the registers known to hold a rank-0 header on
+ * every path to it: scalar results lay one down, truth values break it.
+ */
+{
+    uint64_t	*known;
+    bool	changed = true;
+    int		n;
+
+    if ((known = (uint64_t *)malloc(sizeof(uint64_t) * prog->ninsns)) == (uint64_t *)NULL)
+	die(NOMEM);
+    for (n = 0; n < prog->ninsns; n++)
+	known[n] = ~0ULL;
+    known[entry] = 0;
+
+    while (changed)
+    {
+	changed = false;
+	for (n = 0; n < prog->ninsns; n++)
+	{
+	    insn	*ip = prog->code + n;
+	    uint64_t	after = known[n], bit;
+
+	    if (!seen[n] || !compilable(ip))
+		continue;
+	    bit = (ip->dst < 64) ? 1ULL << ip->dst : 0;
+	    switch (ip->op)
+	    {
+	    case OP_CONST: case OP_SLOAD:
+	    case OP_SADD: case OP_SSUBTRACT: case OP_SMULTIPLY: case OP_SDIVIDE:
+	    case OP_SPOWER: case OP_SUMINUS: case OP_SABS: case OP_SFUNC:
+		after |= bit;
+		break;
+	    case OP_SEQ: case OP_SNE: case OP_SLT: case OP_SGT: case OP_SLE: case OP_SGE:
+	    case OP_AND: case OP_OR:
+		after &= ~bit;
+		break;
+	    default:
+		break;
+	    }
+	    if (falls_through(ip) && n + 1 < prog->ninsns
+		&& (known[n + 1] & after) != known[n + 1])
+	    {
+		known[n + 1] &= after;
+		changed = true;
+	    }
+	    if (branches(ip) && (known[ip->target] & after) != known[ip->target])
+	    {
+		known[ip->target] &= after;
+		changed = true;
+	    }
+	}
+    }
+    return(known);
+}
+
+static void native(insn *ip, uint64_t known, int n, int *fixups, int *nfixups)
+/* generate the machine code for one instruction */
+{
+    int		op;
+
+    if (!compilable(ip))
+    {
+	bytes(1, 0xB8);			/* mov eax, n */
+	dword(n);
+	bytes(1, 0xE9);			/* jmp epilogue */
+	fixups[(*nfixups)++] = len;
+	dword(-1);
+	return;
+    }
+
+    switch (ip->op)
+    {
+    case OP_CONST:
+	bytes(2, 0x48, 0xB8);		/* mov rax, number */
+	{
+	    uint64_t	bits;
+
+	    memcpy(&bits, &ip->tree->u.numval, sizeof(bits));
+	    qword(bits);
+	}
+	bytes(5, 0x66, 0x48, 0x0F, 0x6E, 0xC0);	/* movq xmm0, rax */
+	result(ip->dst, known);
+	break;
+
+    case OP_SLOAD:
+	movsd_load(0, RBP, VAR(ip->slot, number));
+	result(ip->dst, known);
+	break;
+
+    case OP_STORE:
+	movsd_load(0, RBX, REG(ip->a, number));
+	movsd_store(RBP, VAR(ip->slot, number), 0);
+	break;
+
+    case OP_SADD: case OP_SSUBTRACT: case OP_SMULTIPLY: case OP_SDIVIDE:
+	op = (ip->op == OP_SADD) ? 0x58 : (ip->op == OP_SSUBTRACT) ? 0x5C
+	    : (ip->op == OP_SMULTIPLY) ? 0x59 : 0x5E;
+	movsd_load(0, RBX, REG(ip->a, number));
+	movsd_load(1, RBX, REG(ip->b, number));
+	bytes(4, 0xF2, 0x0F, op, 0xC1);	/* addsd etc. xmm0, xmm1 */
+	result(ip->dst, known);
+	break;
+
+    case OP_SPOWER:
+	movsd_load(0, RBX, REG(ip->a, number));
+	movsd_load(1, RBX, REG(ip->b, number));
+	call((void *)pow);
+	result(ip->dst, known);
+	break;
+
+    case OP_SFUNC:
+	movsd_load(0, RBX, REG(ip->a, number));
+	call((void *)ip->f.sfn);
+	result(ip->dst, known);
+	break;
+
+    case OP_SUMINUS:
+    case OP_SABS:
+	movsd_load(0, RBX, REG(ip->a, number));
+	sign(ip->op == OP_SUMINUS ? 7 : 6);
+	result(ip->dst, known);
+	break;
+
+    case OP_SEQ: case OP_SNE: case OP_SLT: case OP_SGT: case OP_SLE: case OP_SGE:
+	compare(ip);
+	break;
+
+    case OP_AND:
+    case OP_OR:
+	connective(ip);
+	break;
+
+    case OP_JUMPT:
+    case OP_JUMPF:
+	bytes(1, 0x83);			/* cmp dword [rbx + a.rank], 0 */
+	modrm(7, RBX, REG(ip->a, rank));
+	bytes(1, 0x00);
+	bytes(2, 0x0F, ip->op == OP_JUMPT ? 0x85 : 0x84);	/* jne/je */
+	fixups[(*nfixups)++] = len;
+	dword(ip->target);
+	break;
+
+    case OP_JUMP:
+	bytes(1, 0xE9);			/* jmp */
+	fixups[(*nfixups)++] = len;
+	dword(ip->target);
+	break;
+
+    case OP_RETURN:
+    case OP_STOP:
+	bytes(1, 0xB8);			/* mov eax, RAN_RETURN or RAN_STOP */
+	dword(ip->op == OP_RETURN ? RAN_RETURN : RAN_STOP);
+	bytes(1, 0xE9);			/* jmp epilogue */
+	fixups[(*nfixups)++] = len;
+	dword(-1);
+	break;
+
+    default:
+	die("internal error -- can't compile opcode %d\n", ip->op);
+    }
+}
+
+static jitfn assemble(int entry, bool *seen, size_t *size)
+/* generate the native code for a block */
+{
+    uint64_t	*known = headers(entry, seen);
+    int		*labels, *fixups, nfixups = 0, count = 0, n;
+    void	*map;
+
+    for (n = 0; n < prog->ninsns; n++)
+	count += seen[n];
+    labels = (int *)malloc(sizeof(int) * prog->ninsns);
+    fixups = (int *)malloc(sizeof(int) * (count + 1));
+    out = (unsigned char *)malloc(MAXINSN * count + EXTRA);
+    if (labels == (int *)NULL || fixups == (int *)NULL || out == (unsigned char *)NULL)
+	die(NOMEM);
+    len = 0;
+
+    /* keep the registers and the frame where calls leave them alone */
+    bytes(1, 0x53);				/* push rbx */
+    bytes(1, 0x55);				/* push rbp */
+    bytes(4, 0x48, 0x83, 0xEC, 0x08);		/* sub rsp, 8 */
+    bytes(3, 0x48, 0x89, 0xFB);			/* mov rbx, rdi */
+    bytes(3, 0x48, 0x89, 0xF5);			/* mov rbp, rsi */
+
+    /* the entry comes first, so the code falls into it */
+    for (n = entry; n < prog->ninsns; n++)
+	if (seen[n])
+	{
+	    labels[n] = len;
+	    native(prog->code + n, known[n], n, fixups, &nfixups);
+	}
+    for (n = 0; n < entry; n++)
+	if (seen[n])
+	{
+	    labels[n] = len;
+	    native(prog->code + n, known[n], n, fixups, &nfixups);
+	}
+
+    n = len;
+    bytes(4, 0x48, 0x83, 0xC4, 0x08);		/* add rsp, 8 */
+    bytes(1, 0x5D);				/* pop rbp */
+    bytes(1, 0x5B);				/* pop rbx */
+    bytes(1, 0xC3);				/* ret */
+
+    /* branches hold their target instruction, or -1 for the epilogue */
+    while (nfixups--)
+    {
+	int	at = fixups[nfixups], to;
+
+	memcpy(&to, out + at, sizeof(to));
+	to = (to < 0) ? n : labels[to];
+	to -= at + 4;
+	memcpy(out + at, &to, sizeof(to));
+    }
+
+    *size = len;
+    map = mmap((void *)NULL, len, PROT_READ | PROT_WRITE,
+	       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED)
+	die(NOMEM);
+    memcpy(map, out, len);
+    if (mprotect(map, len, PROT_READ | PROT_EXEC) != 0)
+	die("can't make native code executable\n");
+
+    free(out);
+    free(labels);
+    free(fixups);
+    free(known);
+    return((jitfn)map);
+}
+#endif /* HAVE_JIT */
+
+/****************************************************************************
+ *
+ * Entry points
+ *
+ ****************************************************************************/
+
+void jit_start(program *p)
+/* get ready to compile the blocks of a program */
+{
+    insn	*ip;
+    node	*np;
+
+    prog = p;
+    blocks = (block *)calloc(prog->ninsns, sizeof(block));
+    watched = (bool *)calloc(nslots + 1, sizeof(bool));
+    if (blocks == (block *)NULL || watched == (bool *)NULL)
+	die(NOMEM);
+
+    for (ip = prog->code; ip < prog->code + prog->ninsns; ip++)
+	if (ip->op == OP_WATCH)
+	    for_cdr(np, ip->tree)
+		watched[np->car->syminf->slot] = true;
+}
+
+jitfn jit_code(int entry)
+/* count a PERFORM of the block at entry, returning its native code if any */
+{
+    block	*bp = blocks + entry;
+
+    if (bp->code || bp->failed)
+	return(bp->code);
+    if (++bp->calls < (jitlevel >= 2 ? 1 : JIT_HOT))
+	return((jitfn)NULL);
+
+#ifdef HAVE_JIT
+    if (compilable(prog->code + entry))
+    {
+	bool	*seen = reach(entry);
+
+	bp->code = assemble(entry, seen, &bp->size);
+	if (jitlevel >= 2)
+	    bp->reference = reference(seen);
+	free(seen);
+    }
+#endif /* HAVE_JIT */
+    bp->failed = (bp->code == (jitfn)NULL);
+    return(bp->code);
+}
+
+program *jit_reference(int entry)
+/* the program with the ways out of a compiled block marked */
+{
+    return(blocks[entry].reference);
+}
+
+void jit_finish(void)
+/* release all native code */
+{
+    int		n;
+
+    if (blocks == (block *)NULL)
+	return;
+    for (n = 0; n < prog->ninsns; n++)
+    {
+#ifdef HAVE_JIT
+	if (blocks[n].code)
+	    (void) munmap((void *)blocks[n].code, blocks[n].size);
+#endif /* HAVE_JIT */
+	if (blocks[n].reference)
+	{
+	    free(blocks[n].reference->code);
+	    free(blocks[n].reference);
+	}
+    }
+    free(blocks);
+    free(watched);
+    blocks = (block *)NULL;
+    watched = (bool *)NULL;
+}
+
+/* jit.c ends here */
@@ -0,0 +1,176 @@
+/*****************************************************************************
+
+NAME
+   lu.c -- LU factorization, for determinants and inverses
+
+SYNOPSIS
+   int lu_factor(scalar *a, int n, int *piv)	-- factor in place
+   void lu_invert(scalar *a, int n, const int *piv, scalar *x)
+						-- inverse from factors
+
+DESCRIPTION
+   lu_factor() overwrites the n-by-n matrix a, stored by rows, with its
+LU factors under partial pivoting: P * A = L * U, with the unit lower
+triangle of L below the diagonal and U on and above it.  Row j was
+exchanged with row piv[j] at step j.  The return value is the sign of
+the permutation, or 0 if a zero pivot turned up, in which case the
+matrix is singular and the factors are incomplete.
+
+   lu_invert() takes a completed factorization and leaves the inverse
+of the original matrix in x by solving L * U * X = P with two block
+triangular solves.
+
+   Both work in column blocks of NB.  The panel of each block is
+factored a column at a time, and the rest of the matrix is then
+brought up to date with one call to matmul_sub(), which is where
+nearly all the arithmetic happens (and where it is spread across the
+worker pool).  The triangular solves are blocked the same way.
+
+LICENSE
+   SPDX-License-Identifier: BSD-2-clause
+
+*****************************************************************************/
+/*LINTLIBRARY*/
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "cupl.h"
+
+#define NB	64	/* columns per block */
+
+#define A(i, j)	a[(long)(i) * n + (j)]
+
+static void swap_rows(scalar *a, int n, int i, int j)
+/* exchange two rows of an n-by-n matrix */
+{
+    scalar	*ri = &A(i, 0), *rj = &A(j, 0);
+    int		c;
+
+    for (c = 0; c < n; c++)
+    {
+	scalar	t = ri[c];
+
+	ri[c] = rj[c];
+	rj[c] = t;
+    }
+}
+
+int lu_factor(scalar *a, int n, int *piv)
+/* factor a matrix in place, returning the permutation sign or 0 */
+{
+    int		sign = 1;
+    int		k0, kb, j, i, c;
+
+    for (k0 = 0; k0 < n; k0 += NB)
+    {
+	kb = (n - k0 < NB) ? n - k0 : NB;
+
+	/* factor the panel, columns k0 through k0 + kb - 1 */
+	for (j = k0; j < k0 + kb; j++)
+	{
+	    int		p = j;
+	    scalar	big = fabs(A(j, j));
+
+	    for (i = j + 1; i < n; i++)
+		if (fabs(A(i, j)) > big)
+		{
+		    big = fabs(A(i, j));
+		    p = i;
+		}
+	    if (big == 0)
+		return(0);
+
+	    piv[j] = p;
+	    if (p != j)
+	    {
+		swap_rows(a, n, j, p);
+		sign = -sign;
+	    }
+
+	    for (i = j + 1; i < n; i++)
+	    {
+		scalar	l = (A(i, j) /= A(j, j));
+
+		for (c = j + 1; c < k0 + kb; c++)
+		    A(i, c) -= l * A(j, c);
+	    }
+	}
+
+	/* the block row of U right of the panel: solve L11 * U12 = A12 */
+	for (i = k0 + 1; i < k0 + kb; i++)
+	    for (j = k0; j < i; j++)
+	    {
+		scalar	l = A(i, j);
+
+		for (c = k0 + kb; c < n; c++)
+		    A(i, c) -= l * A(j, c);
+	    }
+
+	/* and the trailing matrix: A22 -= L21 * U12 */
+	matmul_sub(&A(k0 + kb, k0 + kb), n,
+		   &A(k0 + kb, k0), n,
+		   &A(k0, k0 + kb), n,
+		   n - k0 - kb, n - k0 - kb, kb);
+    }
+
+    return(sign);
+}
+
+void lu_invert(scalar *a, int n, const int *piv, scalar *x)
+/* compute the inverse of a factored matrix */
+{
+    int		i0, ib, i, j, c;
+
+#define X(i, j)	x[(long)(i) * n + (j)]
+
+    /* start from the permuted identity */
+    memset(x, '\0', sizeof(scalar) * n * n);
+    for (i = 0; i < n; i++)
+	X(i, i) = 1;
+    for (j = 0; j < n; j++)
+	if (piv[j] != j)
+	    swap_rows(x, n, j, piv[j]);
+
+    /* forward substitution, L * Y = P */
+    for (i0 = 0; i0 < n; i0 += NB)
+    {
+	ib = (n - i0 < NB) ? n - i0 : NB;
+
+	matmul_sub(&X(i0, 0), n, &A(i0, 0), n, &X(0, 0), n, ib, n, i0);
+	for (i = i0 + 1; i < i0 + ib; i++)
+	    for (j = i0; j < i; j++)
+	    {
+		scalar	l = A(i, j);
+
+		for (c = 0; c < n; c++)
+		    X(i, c) -= l * X(j, c);
+	    }
+    }
+
+    /* back substitution, U * X = Y */
+    for (i0 = ((n - 1) / NB) * NB; i0 >= 0; i0 -= NB)
+    {
+	ib = (n - i0 < NB) ? n - i0 : NB;
+
+	matmul_sub(&X(i0, 0), n, &A(i0, i0 + ib), n, &X(i0 + ib, 0), n,
+		   ib, n, n - i0 - ib);
+	for (i = i0 + ib - 1; i >= i0; i--)
+	{
+	    scalar	d = A(i, i);
+
+	    for (j = i + 1; j < i0 + ib; j++)
+	    {
+		scalar	u = A(i, j);
+
+		for (c = 0; c < n; c++)
+		    X(i, c) -= u * X(j, c);
+	    }
+	    for (c = 0; c < n; c++)
+		X(i, c) /= d;
+	}
+    }
+
+#undef X
+}
+
+/* lu.c ends here */
@@ -4,11 +4,14 @@ NAME
    main.c -- main sequence of the CUPL compiler
 
 SYNOPSIS
-   cupl [-vn[y]] [-w nn] [-f nn] [file...]
+   cupl [-c] [-d file] [-i var=file] [-m] [-o var=file] [-O] [-p] [-P file] [-t] [-j nn] [-J n] [-vn[y]] [-w nn] [-f nn] [file...]
 
 DESCRIPTION
    Main sequence of the Cornell University Programming Language interpreter.
-All the real work is done by yyparse. May set globals verbose and yydebug.
+All the real work is done by yyparse. May set globals verbose, treewalk,
+optimize, translating, profiling, samplefile, accounting, jitlevel and yydebug, sets the size of the worker pool, and may name a file for
+READ to take its data from and matrix files for variables to be loaded
+from or saved to.
 
 LICENSE
    SPDX-License-Identifier: BSD-2-clause
@@ -27,11 +30,17 @@ extern int yylineno;		/* the current source line count */
 extern int yydebug;		/* enable YACC instrumentation? */
 
 #define CANTOPN	"can't open file %s\n"
-#define USAGE	"usage: cupl [-vn[y]] [-w nn] [file...]\n"
+#define USAGE	"usage: cupl [-c] [-d file] [-i var=file] [-m] [-o var=file] [-O] [-p] [-P file] [-t] [-j nn] [-J n] [-vn[y]] [-w nn] [file...]\n"
 
 int verbose;		/* verbosity level of the interpreter */
 int linewidth = 80;	/* line width used for field wrapping */
 int fieldwidth = 20;	/* field width */
+bool treewalk;		/* evaluate the tree directly, not bytecode? */
+bool optimize;		/* simplify expressions before running? */
+bool translating;	/* write the program as C instead of running it? */
+bool profiling;		/* time statements and PERFORMs, for -p? */
+char *samplefile;	/* where -P writes sampled stacks, if anywhere */
+int jitlevel = 1;	/* 0 = no native code, 1 = native code, 2 = checked */
 
 static int execfile(const char *file)
 /* translate a CUPL file in the current directory */
@@ -47,26 +56,83 @@ static int execfile(const char *file)
 	}
     }
 
+    yylineno = 1;
     yyparse();		/* build and interpret the parse tree */
 
     if (file)
 	(void) fclose(yyin);
 
+    /* the tree and symbols go all at once, ready for the next file */
+    clear_symbols();
+    corc = false;
+    arena_release();
+
+    if (accounting)
+	account_report();
+
     return(0);
 }
 
 int
 main(int argc, char *argv[])
 {
-    int	c;
+    int		c;
+    char	*datafile = (char *)NULL;
 
-    while ((c = getopt(argc, argv, "f:v:w:")) != EOF)
+    /* by default, matrix work may use every processor */
+    pool_threads((int)sysconf(_SC_NPROCESSORS_ONLN));
+
+    while ((c = getopt(argc, argv, "cd:f:i:J:j:mo:OpP:tv:w:")) != EOF)
 	switch (c)
 	{
+	case 'c':
+	    translating = true;
+	    break;
+
+	case 'd':
+	    datafile = optarg;
+	    break;
+
 	case 'f':
 	    fieldwidth = atoi(optarg);
 	    break;
 
+	case 'i':
+	    bind_matrix(optarg, false);
+	    break;
+
+	case 'J':
+	    jitlevel = atoi(optarg);
+	    break;
+
+	case 'j':
+	    pool_threads(atoi(optarg));
+	    break;
+
+	case 'm':
+	    accounting = true;
+	    break;
+
+	case 'o':
+	    bind_matrix(optarg, true);
+	    break;
+
+	case 'O':
+	    optimize = true;
+	    break;
+
+	case 'p':
+	    profiling = true;
+	    break;
+
+	case 'P':
+	    samplefile = optarg;
+	    break;
+
+	case 't':
+	    treewalk = true;
+	    break;
+
 	case 'v':
 	    verbose = atoi(optarg);
 	    if (strchr(optarg, 'y'))
@@ -82,6 +148,17 @@ main(int argc, char *argv[])
 	    break;
 	}
 
+    /* native code has no statements to count */
+    if (profiling)
+	jitlevel = 0;
+
+    if (datafile)
+    {
+	if (optind == argc && strcmp(datafile, "-") == 0)
+	    die("the program and its data can't both come from standard input\n");
+	data_open(datafile);
+    }
+
     if (optind == argc)
 	return(execfile((char *)NULL));
     else
@@ -0,0 +1,286 @@
+/*****************************************************************************
+
+NAME
+   matmul.c -- matrix multiply kernel
+
+SYNOPSIS
+   void matmul(scalar *c, const scalar *a, const scalar *b,
+	       int m, int n, int k)	-- c = a * b
+   void matmul_sub(scalar *c, int ldc, const scalar *a, int lda,
+		   const scalar *b, int ldb,
+		   int m, int n, int k)	-- c -= a * b
+
+DESCRIPTION
+   matmul() multiplies the m-by-k matrix a by the k-by-n matrix b,
+leaving the m-by-n product in c.  All three are stored by rows, as SUB()
+lays them out; c must not overlap a or b.  matmul_sub() subtracts the
+product from c instead, and takes each matrix as a block of a larger
+one whose rows are ld apart; the LU code uses it for its updates.
+
+   The product is built up a block at a time.  A KC-by-NC block of b is
+copied into a buffer in strips NR columns wide, so that the innermost
+loop walks it sequentially, and each MR-by-NR tile of c is accumulated
+in registers across the whole strip before being stored.  On x86-64
+processors with AVX2 and FMA the tile kernel uses those instructions;
+the choice is made once, at the first call.  Elsewhere, and for the
+ragged edges of the matrix, a portable kernel is used.  The portable
+kernel adds the products for each element in the same order as the
+textbook triple loop, so it gives identical results; the FMA kernel
+differs only by rounding.  Bands of rows are spread across the worker
+pool when the product is big enough.
+
+   Compile with -DMATCHECK to check every product against the textbook
+triple loop.
+
+LICENSE
+   SPDX-License-Identifier: BSD-2-clause
+
+*****************************************************************************/
+/*LINTLIBRARY*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "cupl.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define HAVE_AVX2_KERNEL
+#endif /* defined(__GNUC__) && defined(__x86_64__) */
+
+#define MR	4	/* rows of c in a register tile */
+#define NR	8	/* columns of c in a register tile */
+#define KC	256	/* depth of a block of b */
+#define NC	128	/* width of a block of b; a multiple of NR */
+
+typedef void (*kernel)(int kc, const scalar *a, int lda,
+		       const scalar *bp, scalar *c, int ldc);
+
+static void kernel_portable(int kc, const scalar *a, int lda,
+			    const scalar *bp, scalar *c, int ldc)
+/* c[MR][NR] += a[MR][kc] * bp[kc][NR], portably */
+{
+    scalar	acc[MR][NR];
+    int		i, j, p;
+
+    for (i = 0; i < MR; i++)
+	for (j = 0; j < NR; j++)
+	    acc[i][j] = c[i * ldc + j];
+
+    for (p = 0; p < kc; p++, bp += NR)
+	for (i = 0; i < MR; i++)
+	{
+	    scalar	aip = a[i * lda + p];
+
+	    for (j = 0; j < NR; j++)
+		acc[i][j] += aip * bp[j];
+	}
+
+    for (i = 0; i < MR; i++)
+	for (j = 0; j < NR; j++)
+	    c[i * ldc + j] = acc[i][j];
+}
+
+#ifdef HAVE_AVX2_KERNEL
+__attribute__((target("avx2,fma")))
+static void kernel_avx2(int kc, const scalar *a, int lda,
+			const scalar *bp, scalar *c, int ldc)
+/* c[MR][NR] += a[MR][kc] * bp[kc][NR], with AVX2 and FMA */
+{
+    __m256d	c00 = _mm256_loadu_pd(c),		c01 = _mm256_loadu_pd(c + 4);
+    __m256d	c10 = _mm256_loadu_pd(c + ldc),	c11 = _mm256_loadu_pd(c + ldc + 4);
+    __m256d	c20 = _mm256_loadu_pd(c + 2 * ldc),	c21 = _mm256_loadu_pd(c + 2 * ldc + 4);
+    __m256d	c30 = _mm256_loadu_pd(c + 3 * ldc),	c31 = _mm256_loadu_pd(c + 3 * ldc + 4);
+    int		p;
+
+    for (p = 0; p < kc; p++, bp += NR)
+    {
+	__m256d	b0 = _mm256_loadu_pd(bp), b1 = _mm256_loadu_pd(bp + 4);
+	__m256d	ai;
+
+	ai = _mm256_broadcast_sd(a + p);
+	c00 = _mm256_fmadd_pd(ai, b0, c00);
+	c01 = _mm256_fmadd_pd(ai, b1, c01);
+	ai = _mm256_broadcast_sd(a + lda + p);
+	c10 = _mm256_fmadd_pd(ai, b0, c10);
+	c11 = _mm256_fmadd_pd(ai, b1, c11);
+	ai = _mm256_broadcast_sd(a + 2 * lda + p);
+	c20 = _mm256_fmadd_pd(ai, b0, c20);
+	c21 = _mm256_fmadd_pd(ai, b1, c21);
+	ai = _mm256_broadcast_sd(a + 3 * lda + p);
+	c30 = _mm256_fmadd_pd(ai, b0, c30);
+	c31 = _mm256_fmadd_pd(ai, b1, c31);
+    }
+
+    _mm256_storeu_pd(c, c00);			_mm256_storeu_pd(c + 4, c01);
+    _mm256_storeu_pd(c + ldc, c10);		_mm256_storeu_pd(c + ldc + 4, c11);
+    _mm256_storeu_pd(c + 2 * ldc, c20);	_mm256_storeu_pd(c + 2 * ldc + 4, c21);
+    _mm256_storeu_pd(c + 3 * ldc, c30);	_mm256_storeu_pd(c + 3 * ldc + 4, c31);
+}
+#endif /* HAVE_AVX2_KERNEL */
+
+static kernel tile;	/* the tile kernel in use */
+
+static kernel select_kernel(void)
+/* pick the best tile kernel this processor can run */
+{
+#ifdef HAVE_AVX2_KERNEL
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+	return(kernel_avx2);
+#endif /* HAVE_AVX2_KERNEL */
+    return(kernel_portable);
+}
+
+static void edge(int mr, int nr, int kc, const scalar *a, int lda,
+		 const scalar *bp, scalar *c, int ldc)
+/* c[mr][nr] += a[mr][kc] * bp[kc][NR], for tiles cut short by the edges */
+{
+    int		i, j, p;
+
+    for (i = 0; i < mr; i++)
+	for (j = 0; j < nr; j++)
+	{
+	    scalar	sum = c[i * ldc + j];
+
+	    for (p = 0; p < kc; p++)
+		sum += a[i * lda + p] * bp[p * NR + j];
+	    c[i * ldc + j] = sum;
+	}
+}
+
+static void pack(scalar *bp, const scalar *b, int ldb, int kc, int nc,
+		 scalar sign)
+/* copy sign times a kc-by-nc block of b into strips NR wide, zero-padded */
+{
+    int		jr, p, j;
+
+    for (jr = 0; jr < nc; jr += NR)
+	for (p = 0; p < kc; p++)
+	    for (j = 0; j < NR; j++)
+		*bp++ = (jr + j < nc) ? sign * b[p * ldb + jr + j] : 0;
+}
+
+#ifdef MATCHECK
+static void check(const scalar *c, const scalar *a, const scalar *b,
+		  int m, int n, int k)
+/* compare a product against the textbook triple loop */
+{
+    int		i, j, p;
+
+    for (i = 0; i < m; i++)
+	for (j = 0; j < n; j++)
+	{
+	    scalar	sum = 0, mag = 0;
+
+	    for (p = 0; p < k; p++)
+	    {
+		sum += a[i * k + p] * b[p * n + j];
+		mag += fabs(a[i * k + p] * b[p * n + j]);
+	    }
+	    if (fabs(c[i * n + j] - sum) > 1e-12 * mag)
+		die("matmul: element (%d, %d) is %.17g, expected %.17g\n",
+		    i, j, c[i * n + j], sum);
+	}
+}
+#endif /* MATCHECK */
+
+typedef struct
+{
+    scalar		*c;
+    const scalar	*a, *b;
+    int			ldc, lda, ldb;	/* row strides */
+    int			m, n, k;
+    scalar		sign;		/* 1 to add the product, -1 to subtract */
+}
+product;
+
+static void multiply_rows(void *arg, int lo, int hi)
+/* accumulate the row tiles [lo, hi) of a product */
+{
+    product	*pp = (product *)arg;
+    int		n = pp->n, k = pp->k;
+    int		lda = pp->lda, ldb = pp->ldb, ldc = pp->ldc;
+    int		m = (hi * MR < pp->m) ? hi * MR : pp->m;
+    const scalar *a = pp->a, *b = pp->b;
+    scalar	*c = pp->c, *bp;
+    int		jc, pc, ir, jr;
+
+    if ((bp = (scalar *)malloc(sizeof(scalar) * KC * NC)) == (scalar *)NULL)
+	die(NOMEM);
+
+    for (jc = 0; jc < n; jc += NC)
+    {
+	int	nc = (n - jc < NC) ? n - jc : NC;
+
+	for (pc = 0; pc < k; pc += KC)
+	{
+	    int	kc = (k - pc < KC) ? k - pc : KC;
+
+	    pack(bp, b + pc * ldb + jc, ldb, kc, nc, pp->sign);
+	    for (ir = lo * MR; ir < m; ir += MR)
+	    {
+		int	mr = (m - ir < MR) ? m - ir : MR;
+
+		for (jr = 0; jr < nc; jr += NR)
+		{
+		    int		nr = (nc - jr < NR) ? nc - jr : NR;
+		    const scalar *ap = a + ir * lda + pc;
+		    scalar	*cp = c + ir * ldc + jc + jr;
+
+		    if (mr == MR && nr == NR)
+			tile(kc, ap, lda, bp + jr * kc, cp, ldc);
+		    else
+			edge(mr, nr, kc, ap, lda, bp + jr * kc, cp, ldc);
+		}
+	    }
+	}
+    }
+
+    free(bp);
+}
+
+static void accumulate(product *p)
+/* add or subtract a product into c */
+{
+    if (tile == (kernel)NULL)
+	tile = select_kernel();
+
+    /* bands of row tiles go to separate threads */
+    if (p->m > 0 && p->n > 0 && p->k > 0)
+	parallel_for((p->m + MR - 1) / MR, (long)p->m * p->n * p->k,
+		     multiply_rows, p);
+}
+
+void matmul_sub(scalar *c, int ldc, const scalar *a, int lda,
+		const scalar *b, int ldb, int m, int n, int k)
+/* subtract the product of an m-by-k and a k-by-n block from a block */
+{
+    product	p;
+
+    p.c = c; p.a = a; p.b = b;
+    p.ldc = ldc; p.lda = lda; p.ldb = ldb;
+    p.m = m; p.n = n; p.k = k;
+    p.sign = -1;
+    accumulate(&p);
+}
+
+void matmul(scalar *c, const scalar *a, const scalar *b, int m, int n, int k)
+/* multiply an m-by-k matrix by a k-by-n matrix */
+{
+    product	p;
+
+    memset(c, '\0', sizeof(scalar) * m * n);
+
+    p.c = c; p.a = a; p.b = b;
+    p.ldc = n; p.lda = k; p.ldb = n;
+    p.m = m; p.n = n; p.k = k;
+    p.sign = 1;
+    accumulate(&p);
+
+#ifdef MATCHECK
+    check(c, a, b, m, n, k);
+#endif /* MATCHECK */
+}
+
+/* matmul.c ends here */
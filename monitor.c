@@ -11,18 +11,33 @@ SYNOPSIS
     void copy_value(value v);
     value allocate_value(int rank, int i, int j)
     void deallocate_value(value *v)
+    void unshare_value(value *v)
+
+    void account_alloc(allockind kind, size_t bytes)
+    void account_free(allockind kind, size_t bytes)
+    void account_report(void)
 
     void cupl_reset_write()
     void cupl_eol_write()
+    void cupl_flush_write()
     void cupl_scalar_write(char *name, scalar quant)
     void cupl_string_write(char *s)
 
+    value cupl_load_matrix(const char *file)
+    void cupl_save_matrix(const char *file, value v)
+
     value cupl_add(value, value)
     value cupl_multiply(value, value)
     value cupl_subtract(value, value)
     value cupl_divide(value, value)
     value cupl_uminus(value, value)
 
+    void cupl_add_into(value *, value, value)
+    void cupl_subtract_into(value *, value, value)
+    void cupl_divide_into(value *, value, value)
+    void cupl_uminus_into(value *, value)
+    void cupl_abs_into(value *, value)
+
     value cupl_abs(value)
     value cupl_atan(value)
     value cupl_cos(value)
@@ -53,9 +68,17 @@ SYNOPSIS
 DESCRIPTION 
    Runtime support.  This is segregated from the execute() code in case anyone
 ever wants to write a back end that is a compiler.  For the same reason
-we do an allocate each time an intrinsic returns a value.  This is
-relatively inefficient but means these functions could be used as a runtime
-library.
+we do an allocate each time an intrinsic returns a vector or matrix value;
+scalars carry their element inline and cost nothing to create.  Copies
+of vectors and matrices share their elements until one of them is about
+to be changed.  This
+means these functions could be used as a runtime library.
+   The _into variants of the elementwise operations leave their result in
+a value supplied by the caller, reusing its storage when the shape fits.
+The destination may be one of the operands, which lets an evaluator that
+owns an operand temporary do the arithmetic in place.
+   With accounting on (cupl -m) each allocation is counted against the
+kind of storage it was made for, and account_report() gives the totals.
 
 LICENSE
    SPDX-License-Identifier: BSD-2-clause
@@ -65,10 +88,20 @@ LICENSE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <stddef.h>
+#include <limits.h>
 #include <math.h>
 #include <string.h>
 #include "cupl.h"
 
+#define MATHEADER	32	/* bytes before the elements in a matrix file */
+
 #define max(x, y)	((x) > (y) ? (x) : (y))
 #define min(x, y)	((x) < (y) ? (x) : (y))
 
@@ -83,6 +116,7 @@ void warn(char *msg, ...)
 {
     va_list	args;
 
+    cupl_flush_write();
     va_start(args, msg);
     vfprintf(stderr, msg, args);
     va_end(args);
@@ -93,6 +127,7 @@ noreturn void die(char *msg, ...)
 {
     va_list	args;
 
+    cupl_flush_write();
     va_start(args, msg);
     vfprintf(stderr, msg, args);
     va_end(args);
@@ -100,6 +135,86 @@ noreturn void die(char *msg, ...)
     exit(1);
 }
 
+/****************************************************************************
+ *
+ * Allocation accounting
+ *
+ ****************************************************************************/
+
+/*
+ * A vector or matrix buffer is charged to the kind of storage that
+ * allocated it, whatever holds it later: a temporary an assignment
+ * moves into a variable stays a temporary.  Scalars carry their element
+ * inline, so for them only the count means anything.  Copies that share
+ * a buffer allocate nothing, but how many there were shows what sharing
+ * saves.
+ */
+typedef struct
+{
+    long	count;		/* allocations */
+    size_t	bytes;		/* bytes allocated in all */
+    size_t	live;		/* bytes allocated and not yet freed */
+    size_t	peak;		/* most ever live at once */
+}
+account;
+
+bool accounting;		/* count allocations, for -m? */
+
+static account accounts[ALLOC_KINDS];
+static size_t live, peak;	/* over all kinds */
+static long shares;		/* copies that shared elements */
+
+static const char *kindnames[ALLOC_KINDS] =
+{
+    "parse", "scalar temp", "matrix temp", "variable",
+};
+
+void account_alloc(allockind kind, size_t bytes)
+/* charge an allocation to a kind of storage */
+{
+    account	*ap = &accounts[kind];
+
+    ap->count++;
+    ap->bytes += bytes;
+    if ((ap->live += bytes) > ap->peak)
+	ap->peak = ap->live;
+    if ((live += bytes) > peak)
+	peak = live;
+}
+
+void account_free(allockind kind, size_t bytes)
+/* credit a kind of storage with bytes freed */
+{
+    accounts[kind].live -= bytes;
+    live -= bytes;
+}
+
+void account_report(void)
+/* write the allocation counts to standard error, and start again */
+{
+    int		n;
+
+    cupl_flush_write();
+    (void) fprintf(stderr, "\n  storage             count          bytes           live           peak\n");
+    for (n = 0; n < ALLOC_KINDS; n++)
+	(void) fprintf(stderr, "  %-12s %12ld %14zu %14zu %14zu\n",
+		       kindnames[n], accounts[n].count, accounts[n].bytes,
+		       accounts[n].live, accounts[n].peak);
+    (void) fprintf(stderr, "  %-12s %12s %14s %14zu %14zu\n",
+		   "all", "", "", live, peak);
+    (void) fprintf(stderr, "  %ld copies shared their elements\n", shares);
+
+    /* what is still live is still owed */
+    for (n = 0; n < ALLOC_KINDS; n++)
+    {
+	accounts[n].count = 0;
+	accounts[n].bytes = 0;
+	accounts[n].peak = accounts[n].live;
+    }
+    peak = live;
+    shares = 0;
+}
+
 /****************************************************************************
  *
  * Value allocation
@@ -109,21 +224,63 @@ noreturn void die(char *msg, ...)
 void make_scalar(value *v, scalar i)
 /* initialize a scalar value element */
 {
+    if (accounting)
+	account_alloc(ALLOC_SCALAR, 0);
     v->rank = 0;
     v->width = v->depth = 1;
-    v->elements = (scalar *)malloc(sizeof(scalar));
-    v->elements[0] = i;
+    v->elements = (scalar *)NULL;
+    v->number = i;
 }
 
-value copy_value(value v)
-/* male a new copy of a value element */
+/*
+ * Vector and matrix elements live in reference-counted buffers.  Copying
+ * a value just takes another reference, so reading a variable costs the
+ * same whatever its size; anything about to change elements in place
+ * must call unshare_value() first.  The count sits in a header just in
+ * front of the elements, so elements stays a plain array of scalars.
+ * A buffer may also be a private mapping of a matrix file, in which case
+ * the header records the length of the mapping.  The header has to fit
+ * in the MATHEADER bytes in front of the elements in a matrix file.
+ */
+typedef struct
 {
-    value	newvalue = v;
+    int		refs;		/* values referring to this buffer */
+    int		kind;		/* storage it is charged to */
+    size_t	mapped;		/* length of the file mapping, if mapped */
+    size_t	size;		/* bytes it takes, header and all */
+    scalar	data[];		/* the elements themselves */
+}
+buffer;
 
-    newvalue.elements = (scalar *)malloc(sizeof(scalar) * v.width * v.depth);
-    memcpy(newvalue.elements, v.elements,
-	   sizeof(scalar) * v.width * v.depth);
-    return(newvalue);
+#define BUFFER(p)	((buffer *)((char *)(p) - offsetof(buffer, data)))
+
+static scalar *new_elements(int n, allockind kind)
+/* get an element buffer with one reference */
+{
+    buffer	*b;
+    size_t	size = sizeof(buffer) + sizeof(scalar) * n;
+
+    if ((b = (buffer *)malloc(size)) == (buffer *)NULL)
+	die(NOMEM);
+    b->refs = 1;
+    b->kind = kind;
+    b->mapped = 0;
+    b->size = size;
+    if (accounting)
+	account_alloc(kind, size);
+    return(b->data);
+}
+
+value copy_value(value v)
+/* male a new copy of a value element, sharing its elements */
+{
+    if (v.rank > 0 && v.elements)
+    {
+	BUFFER(v.elements)->refs++;
+	if (accounting)
+	    shares++;
+    }
+    return(v);
 }
 
 value allocate_value(int rank, int i, int j)
@@ -133,18 +290,48 @@ value allocate_value(int rank, int i, int j)
 
     v.rank = rank;
     v.width = j; v.depth = i;
-    v.elements = (scalar *)calloc(sizeof(scalar), i * j);
+    v.number = 0;
+    if (rank > 0)
+    {
+	v.elements = new_elements(i * j, ALLOC_TEMP);
+	memset(v.elements, '\0', sizeof(scalar) * i * j);
+    }
+    else
+	v.elements = (scalar *)NULL;
 
     return(v);
 }
 
 void deallocate_value(value *v)
-/* destroy a value copy, only if its reference count is 1 */
+/* destroy a value copy, freeing its elements with the last reference */
 {
-    (void) free(v->elements);
+    if (v->rank > 0 && v->elements && --BUFFER(v->elements)->refs == 0)
+    {
+	buffer	*b = BUFFER(v->elements);
+
+	if (accounting)
+	    account_free(b->kind, b->size);
+	if (b->mapped)
+	    (void) munmap((char *)b->data - MATHEADER, b->mapped);
+	else
+	    (void) free(b);
+    }
     v->elements = (scalar *)NULL;
 }
 
+void unshare_value(value *v)
+/* give a value its own copy of its elements, ready to be changed */
+{
+    if (v->rank > 0 && v->elements && BUFFER(v->elements)->refs > 1)
+    {
+	int	n = v->width * v->depth;
+	scalar	*elements = new_elements(n, ALLOC_VARIABLE);
+
+	memcpy(elements, v->elements, sizeof(scalar) * n);
+	BUFFER(v->elements)->refs--;
+	v->elements = elements;
+    }
+}
 
 /****************************************************************************
  *
@@ -152,8 +339,288 @@ void deallocate_value(value *v)
  *
  ****************************************************************************/
 
+/*
+ * Output is collected in outbuf and handed to stdio in big blocks.  It
+ * has to be flushed before anything else is written, so warn() and
+ * die() do that, as does the end of execution.  When the output is a
+ * terminal, or the trace is on, it goes out a line at a time instead.
+ */
+#define OUTBUF	65536
+
+static char outbuf[OUTBUF];
+static size_t outlen;
+static int lineflush = -1;	/* flush at each end of line? -1 = not known */
 static int used;
 
+void cupl_flush_write(void)
+/* hand buffered output to stdio */
+{
+    if (outlen)
+	(void) fwrite(outbuf, 1, outlen, stdout);
+    outlen = 0;
+}
+
+static void emit(const char *s, size_t n)
+/* append n characters to the output */
+{
+    if (outlen + n > OUTBUF)
+    {
+	cupl_flush_write();
+	if (n > OUTBUF)
+	{
+	    (void) fwrite(s, 1, n, stdout);
+	    return;
+	}
+    }
+    memcpy(outbuf + outlen, s, n);
+    outlen += n;
+}
+
+static void emit_padded(const char *s, size_t n, int width, bool left)
+/* emit s in a field of width, like printf's %*s; negative width means left */
+{
+    static const char	spaces[] = "                                ";
+    long		pad;
+
+    if (width < 0)
+    {
+	width = -width;
+	left = true;
+    }
+    pad = (long)width - (long)n;
+
+    if (left)
+	emit(s, n);
+    for (; pad > 0; pad -= sizeof(spaces) - 1)
+	emit(spaces, min(pad, (long)sizeof(spaces) - 1));
+    if (!left)
+	emit(s, n);
+}
+
+/*
+ * Numbers are formatted exactly as printf's %.9f and %.9E would do it.
+ * A finite double is m * 2^e for integers m and e, so it can be written
+ * as a (possibly very long) integer N times 10^-k; the wanted digits are
+ * N * 10^(p - k) rounded to an integer, half to even, for the right p.
+ * That is done here with multiple-precision integers, which is exact;
+ * 96 32-bit limbs cover N for the smallest denormal, which is the worst
+ * case.  Where the compiler has 128-bit integers, numbers of ordinary
+ * size are done more directly by dividing m * 10^p by 2^-e.
+ */
+#define LIMBS	96
+
+typedef struct
+{
+    uint32_t	limb[LIMBS];	/* least significant first */
+    int		n;		/* limbs in use */
+}
+bignum;
+
+static const uint32_t pow10[] =
+{
+    1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000,
+};
+
+static void big_multiply(bignum *b, uint32_t f)
+/* b *= f */
+{
+    uint64_t	carry = 0;
+    int		i;
+
+    for (i = 0; i < b->n; i++)
+    {
+	carry += (uint64_t)b->limb[i] * f;
+	b->limb[i] = (uint32_t)carry;
+	carry >>= 32;
+    }
+    if (carry)
+	b->limb[b->n++] = (uint32_t)carry;
+}
+
+static uint32_t big_divide(bignum *b, uint32_t d)
+/* b /= d, returning the remainder */
+{
+    uint64_t	rem = 0;
+    int		i;
+
+    for (i = b->n - 1; i >= 0; i--)
+    {
+	rem = (rem << 32) | b->limb[i];
+	b->limb[i] = (uint32_t)(rem / d);
+	rem %= d;
+    }
+    while (b->n > 0 && b->limb[b->n - 1] == 0)
+	b->n--;
+    return((uint32_t)rem);
+}
+
+static void big_scale(bignum *b, int p)
+/* b *= 10^p, for p >= 0 */
+{
+    for (; p >= 9; p -= 9)
+	big_multiply(b, pow10[9]);
+    big_multiply(b, pow10[p]);
+}
+
+static uint64_t big_round(bignum *b, int p)
+/* b * 10^-p rounded half to even, for p > 0 and a result below 2^64 */
+{
+    bool	sticky = false;	/* anything nonzero below the last digit? */
+    uint32_t	last;
+    uint64_t	q;
+
+    for (p--; p >= 9; p -= 9)
+	sticky |= big_divide(b, pow10[9]) != 0;
+    sticky |= big_divide(b, pow10[p]) != 0;
+    last = big_divide(b, 10);
+
+    q = b->n > 1 ? ((uint64_t)b->limb[1] << 32) | b->limb[0] : b->n ? b->limb[0] : 0;
+    if (last > 5 || (last == 5 && (sticky || (q & 1))))
+	q++;
+    return(q);
+}
+
+static uint64_t digits(scalar x, int p)
+/* |x| * 10^p, correctly rounded; x must be finite and nonzero */
+{
+    bignum	b;
+    uint64_t	m, q;
+    int		e, k;
+
+    /* x = m * 2^e, with m odd */
+    m = (uint64_t)ldexp(frexp(fabs(x), &e), 53);
+    e -= 53;
+    while ((m & 1) == 0)
+    {
+	m >>= 1;
+	e++;
+    }
+
+#ifdef __SIZEOF_INT128__
+    /* most numbers written are small enough to do in 128 bits */
+    if (p >= 0 && p <= 19)
+    {
+	unsigned __int128	t, half;
+	uint64_t		scale = 1;
+
+	for (k = 0; k < p; k++)
+	    scale *= 10;
+	if (e >= 0 && e < 64 && (m >> (63 - e)) == 0)
+	    return((uint64_t)((unsigned __int128)(m << e) * scale));
+	if (e < 0 && e >= -64)
+	{
+	    t = (unsigned __int128)m * scale;
+	    half = (unsigned __int128)1 << (-e - 1);
+	    q = (uint64_t)(t >> -e);
+	    t &= 2 * half - 1;
+	    if (t > half || (t == half && (q & 1)))
+		q++;
+	    return(q);
+	}
+    }
+#endif /* __SIZEOF_INT128__ */
+
+    b.limb[0] = (uint32_t)m;
+    b.limb[1] = (uint32_t)(m >> 32);
+    b.n = b.limb[1] ? 2 : 1;
+
+    /* N = m * 2^e with k = 0 if e >= 0, else N = m * 5^-e with k = -e */
+    k = 0;
+    if (e >= 0)
+    {
+	for (; e >= 31; e -= 31)
+	    big_multiply(&b, 1U << 31);
+	big_multiply(&b, 1U << e);
+    }
+    else
+    {
+	k = -e;
+	for (; e <= -13; e += 13)
+	    big_multiply(&b, 1220703125);	/* 5^13 */
+	for (; e < 0; e++)
+	    big_multiply(&b, 5);
+    }
+
+    if (p >= k)
+    {
+	big_scale(&b, p - k);
+	return(b.n > 1 ? ((uint64_t)b.limb[1] << 32) | b.limb[0] : b.limb[0]);
+    }
+    return(big_round(&b, k - p));
+}
+
+static char *format_unsigned(char *end, uint64_t n, int mindigits)
+/* write n backwards from end, with at least mindigits digits */
+{
+    for (; n || mindigits > 0; mindigits--)
+    {
+	*--end = '0' + n % 10;
+	n /= 10;
+    }
+    return(end);
+}
+
+static int format_fixed(char *buf, scalar x)
+/* format x as %.9f would, returning the length; 0.001 < |x| < 100000 */
+{
+    char	tmp[32], *end = tmp + sizeof(tmp), *s;
+    uint64_t	q = digits(x, 9);
+    int		n;
+
+    s = format_unsigned(end, q % pow10[9], 9);
+    *--s = '.';
+    s = format_unsigned(s, q / pow10[9], 1);
+    if (signbit(x))
+	*--s = '-';
+    n = end - s;
+    memcpy(buf, s, n);
+    return(n);
+}
+
+static int format_exponent(char *buf, scalar x)
+/* format x as %.9E would, returning the length */
+{
+    char	*s = buf, tmp[32], *end = tmp + sizeof(tmp), *t;
+    uint64_t	q = 0;
+    int		exp = 0;
+
+    if (signbit(x))
+	*s++ = '-';
+    if (isnan(x) || isinf(x))
+    {
+	memcpy(s, isnan(x) ? "NAN" : "INF", 3);
+	return(s + 3 - buf);
+    }
+
+    if (x != 0)
+    {
+	/*
+	 * The guess can be one out either way near powers of ten, and
+	 * rounding can carry into an eleventh digit; either way the
+	 * exponent is corrected and the digits done again.
+	 */
+	exp = (int)floor(log10(fabs(x)));
+	for (;;)
+	{
+	    q = digits(x, 9 - exp);
+	    if (q >= 10 * (uint64_t)pow10[9])
+		exp++;
+	    else if (q < pow10[9])
+		exp--;
+	    else
+		break;
+	}
+    }
+    t = format_unsigned(end, (uint64_t)abs(exp), 2);
+    *--t = (exp < 0) ? '-' : '+';
+    *--t = 'E';
+    t = format_unsigned(t, q % pow10[9], 9);
+    *--t = '.';
+    *--t = '0' + q / pow10[9];
+    memcpy(s, t, end - t);
+    return(s + (end - t) - buf);
+}
+
 void cupl_reset_write(void)
 {
     used = 0;
@@ -161,8 +628,13 @@ void cupl_reset_write(void)
 
 void cupl_eol_write(void)
 {
-    (void) putchar('\n');
+    emit("\n", 1);
     used = 0;
+
+    if (lineflush < 0)
+	lineflush = (verbose >= DEBUG_EXECUTE || isatty(fileno(stdout)));
+    if (lineflush)
+	cupl_flush_write();
 }
 
 static void needspace(int w)
@@ -179,25 +651,211 @@ static void needspace(int w)
 void cupl_scalar_write(char *name, scalar quant)
 /* write a numeric or skip a field in CUPL style */
 {
+    char	buf[32];
+    int		n;
+
     if (name)
     {
 	needspace(2 * fieldwidth);
-	(void) printf("%*s = ", fieldwidth - 3, name);
+	emit_padded(name, strlen(name), fieldwidth - 3, false);
+	emit(" = ", 3);
     }
     else
 	needspace(fieldwidth);
 
     if (0.001 < fabs(quant) && fabs(quant) < 100000)
-	(void) printf("%*.9f", fieldwidth, quant);
+	n = format_fixed(buf, quant);
     else
-	(void) printf("%*.9E", fieldwidth, quant);
+	n = format_exponent(buf, quant);
+    emit_padded(buf, n, fieldwidth, false);
 }
 
 void cupl_string_write(char *s)
 /* write a string, or just skip the field */
 {
     needspace(fieldwidth);
-    (void) printf("%-*s", fieldwidth, s);
+    emit_padded(s, strlen(s), fieldwidth, true);
+}
+
+/****************************************************************************
+ *
+ * Binary matrix files
+ *
+ ****************************************************************************/
+
+/*
+ * A matrix file is a MATHEADER-byte header followed by the elements, by
+ * rows, as little-endian IEEE doubles:
+ *
+ *	bytes  0-7	the magic string MATMAGIC
+ *	bytes  8-11	rank (0, 1 or 2)
+ *	bytes 12-15	depth (rows)
+ *	bytes 16-19	width (columns)
+ *	bytes 20-31	zero
+ *
+ * with the numbers in the header little-endian too.  On little-endian
+ * machines a file is loaded by mapping it privately, and the buffer
+ * header is written over the end of the file header in the mapping, so
+ * the elements are used where they lie and pages are only copied if
+ * they are changed.  Elsewhere the elements are read and byte-swapped.
+ */
+#define MATMAGIC	"CUPLMAT1"
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define SWAPPED
+#endif /* __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__ */
+
+static uint32_t get32(const unsigned char *p)
+/* get a little-endian 32-bit number */
+{
+    return(p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+}
+
+static void put32(unsigned char *p, uint32_t n)
+/* store a little-endian 32-bit number */
+{
+    p[0] = n; p[1] = n >> 8; p[2] = n >> 16; p[3] = n >> 24;
+}
+
+#ifdef SWAPPED
+static void swap_elements(scalar *d, const scalar *s, long n)
+/* reverse the bytes of each of n doubles */
+{
+    long	i;
+
+    for (i = 0; i < n; i++)
+    {
+	uint64_t	u;
+
+	memcpy(&u, &s[i], sizeof(u));
+	u = __builtin_bswap64(u);
+	memcpy(&d[i], &u, sizeof(u));
+    }
+}
+#endif /* SWAPPED */
+
+value cupl_load_matrix(const char *file)
+/* load a value from a matrix file */
+{
+    unsigned char	header[MATHEADER];
+    struct stat		st;
+    value		v;
+    long		n;
+    int			fd;
+
+    if ((fd = open(file, O_RDONLY)) < 0)
+	die("can't open matrix file %s\n", file);
+    if (fstat(fd, &st) < 0
+	|| read(fd, header, MATHEADER) != MATHEADER
+	|| memcmp(header, MATMAGIC, 8) != 0)
+	die("%s is not a matrix file\n", file);
+
+    v.rank = get32(header + 8);
+    v.depth = get32(header + 12);
+    v.width = get32(header + 16);
+    n = (long)v.depth * v.width;
+    if (v.rank > 2 || v.depth < 0 || v.width < 0 || n > INT_MAX
+	|| (v.rank == 0 && n != 1)
+	|| st.st_size != MATHEADER + (off_t)sizeof(scalar) * n)
+	die("matrix file %s is damaged\n", file);
+    v.number = 0;
+    v.elements = (scalar *)NULL;
+
+    if (v.rank == 0)
+    {
+	if (read(fd, &v.number, sizeof(scalar)) != sizeof(scalar))
+	    die("can't read matrix file %s\n", file);
+#ifdef SWAPPED
+	swap_elements(&v.number, &v.number, 1);
+#endif /* SWAPPED */
+    }
+    else
+    {
+#ifndef SWAPPED
+	char	*map;
+	buffer	*b;
+
+	map = mmap((void *)NULL, st.st_size, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+	    die("can't map matrix file %s\n", file);
+	b = BUFFER(map + MATHEADER);
+	b->refs = 1;
+	b->kind = ALLOC_VARIABLE;
+	b->mapped = b->size = st.st_size;
+	v.elements = b->data;
+	if (accounting)
+	    account_alloc(ALLOC_VARIABLE, b->size);
+#else
+	v.elements = new_elements(n, ALLOC_VARIABLE);
+	if (read(fd, v.elements, sizeof(scalar) * n) != (ssize_t)(sizeof(scalar) * n))
+	    die("can't read matrix file %s\n", file);
+	swap_elements(v.elements, v.elements, n);
+#endif /* SWAPPED */
+    }
+
+    (void) close(fd);
+    return(v);
+}
+
+void cupl_save_matrix(const char *file, value v)
+/* write a value to a matrix file */
+{
+    unsigned char	header[MATHEADER];
+    struct iovec	iov[2];
+    size_t		left;
+    ssize_t		done;
+    int			fd;
+#ifdef SWAPPED
+    scalar		*swapped;
+#endif /* SWAPPED */
+
+    memset(header, '\0', MATHEADER);
+    memcpy(header, MATMAGIC, 8);
+    put32(header + 8, v.rank);
+    put32(header + 12, v.depth);
+    put32(header + 16, v.width);
+
+    iov[0].iov_base = header;
+    iov[0].iov_len = MATHEADER;
+    iov[1].iov_base = ELEMENTS(v);
+    iov[1].iov_len = sizeof(scalar) * v.width * v.depth;
+#ifdef SWAPPED
+    if ((swapped = (scalar *)malloc(iov[1].iov_len)) == (scalar *)NULL)
+	die(NOMEM);
+    swap_elements(swapped, ELEMENTS(v), (long)v.width * v.depth);
+    iov[1].iov_base = swapped;
+#endif /* SWAPPED */
+
+    if ((fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0)
+	die("can't create matrix file %s\n", file);
+
+    /* one call normally does it, but large writes may come up short */
+    left = iov[0].iov_len + iov[1].iov_len;
+    while (left > 0)
+    {
+	if ((done = writev(fd, iov, 2)) < 0)
+	    die("can't write matrix file %s\n", file);
+	left -= done;
+	if ((size_t)done >= iov[0].iov_len)
+	{
+	    done -= iov[0].iov_len;
+	    iov[0].iov_len = 0;
+	    iov[1].iov_base = (char *)iov[1].iov_base + done;
+	    iov[1].iov_len -= done;
+	}
+	else
+	{
+	    iov[0].iov_base = (char *)iov[0].iov_base + done;
+	    iov[0].iov_len -= done;
+	}
+    }
+    if (close(fd) < 0)
+	die("can't write matrix file %s\n", file);
+
+#ifdef SWAPPED
+    free(swapped);
+#endif /* SWAPPED */
 }
 
 /****************************************************************************
@@ -210,40 +868,192 @@ void cupl_string_write(char *s)
 				&& (l.width == r.width) \
 				&& (l.depth == r.depth))
 
-value cupl_add(value left, value right)
-/* add two CUPL values */
+/*
+ * Big operations are cut into pieces for the worker pool.  Each piece
+ * works on the index range it is handed, through one of these.
+ */
+typedef struct
+{
+    scalar	*d;		/* destination elements */
+    scalar	*l, *r;		/* operand elements */
+    int		width, depth;	/* shape, where it matters */
+    int		count;		/* elements in a reduction */
+    scalar	*partial;	/* per-block results of a reduction */
+}
+operands;
+
+/*
+ * Reductions work a block of REDUCE_BLOCK elements at a time and then
+ * combine the block results in order.  The blocks are the same however
+ * many threads there are, so the result is too.
+ */
+#define REDUCE_BLOCK	4096
+
+#define FIRST(b)	((b) * REDUCE_BLOCK)
+#define LAST(o, b)	((b) * REDUCE_BLOCK + REDUCE_BLOCK < (o)->count \
+			 ? (b) * REDUCE_BLOCK + REDUCE_BLOCK : (o)->count)
+
+static scalar reduce(operands *o, void (*part)(void *, int, int),
+		     scalar (*combine)(scalar, scalar))
+/* reduce o->count elements, block by block */
+{
+    int		nblocks = (o->count + REDUCE_BLOCK - 1) / REDUCE_BLOCK;
+    scalar	one, result;
+    int		b;
+
+    if (nblocks <= 1)
+	o->partial = &one;
+    else if ((o->partial = (scalar *)malloc(sizeof(scalar) * nblocks)) == (scalar *)NULL)
+	die(NOMEM);
+
+    parallel_for(nblocks, o->count, part, o);
+
+    result = o->partial[0];
+    for (b = 1; b < nblocks; b++)
+	result = combine(result, o->partial[b]);
+    if (nblocks > 1)
+	free(o->partial);
+    return(result);
+}
+
+static scalar plus(scalar x, scalar y)
+/* combine partial sums */
+{
+    return(x + y);
+}
+
+static scalar larger(scalar x, scalar y)
+/* combine partial maxima */
+{
+    return(x < y ? y : x);
+}
+
+static scalar smaller(scalar x, scalar y)
+/* combine partial minima */
+{
+    return(x > y ? y : x);
+}
+
+static void add_part(void *arg, int lo, int hi)
+/* add a range of elements */
+{
+    operands	*o = (operands *)arg;
+
+    vec_add(o->d + lo, o->l + lo, o->r + lo, hi - lo);
+}
+
+static void subtract_part(void *arg, int lo, int hi)
+/* subtract a range of elements */
+{
+    operands	*o = (operands *)arg;
+
+    vec_subtract(o->d + lo, o->l + lo, o->r + lo, hi - lo);
+}
+
+static void negate_part(void *arg, int lo, int hi)
+/* negate a range of elements */
+{
+    operands	*o = (operands *)arg;
+
+    vec_negate(o->d + lo, o->r + lo, hi - lo);
+}
+
+static void abs_part(void *arg, int lo, int hi)
+/* take the magnitudes of a range of elements */
+{
+    operands	*o = (operands *)arg;
+
+    vec_abs(o->d + lo, o->r + lo, hi - lo);
+}
+
+static void reshape(value *dst, value shape)
+/* make dst a value of the given shape, keeping its storage if it fits */
+{
+    if (dst->rank > 0 && shape.rank > 0
+		&& dst->elements && BUFFER(dst->elements)->refs == 1
+		&& dst->width * dst->depth == shape.width * shape.depth)
+    {
+	dst->rank = shape.rank;
+	dst->width = shape.width;
+	dst->depth = shape.depth;
+    }
+    else
+    {
+	deallocate_value(dst);
+	*dst = allocate_value(shape.rank, shape.depth, shape.width);
+    }
+}
+
+void cupl_add_into(value *dst, value left, value right)
+/* add two CUPL values, leaving the sum in dst */
 {
     if (!CONGRUENT(left, right))
 	die("addition failed, operands of different sizes or ranks\n");
-    else
+    else if (right.rank == 0)
     {
-	value	result;
-	int	n;
+	scalar	x = left.number + right.number;
 
-	result = copy_value(right);
-	for (n = 0; n < left.width * left.depth; n++)
-	    result.elements[n] = left.elements[n] + right.elements[n];
-	return(result);
+	deallocate_value(dst);
+	make_scalar(dst, x);
+    }
+    else
+    {
+	operands	o;
+	int		count = left.width * left.depth;
+
+	o.l = ELEMENTS(left);
+	o.r = ELEMENTS(right);
+	reshape(dst, right);
+	o.d = ELEMENTS(*dst);
+	parallel_for(count, count, add_part, &o);
     }
 }
 
-value cupl_subtract(value left, value right)
-/* subtract two CUPL values */
+void cupl_subtract_into(value *dst, value left, value right)
+/* subtract two CUPL values, leaving the difference in dst */
 {
     if (!CONGRUENT(left, right))
 	die("subtract failed, operands of different sizes or ranks\n");
-    else
+    else if (right.rank == 0)
     {
-	value	result;
-	int	n;
+	scalar	x = left.number - right.number;
 
-	result = copy_value(right);
-	for (n = 0; n < left.width * left.depth; n++)
-	    result.elements[n] = left.elements[n] - right.elements[n];
-	return(result);
+	deallocate_value(dst);
+	make_scalar(dst, x);
+    }
+    else
+    {
+	operands	o;
+	int		count = left.width * left.depth;
+
+	o.l = ELEMENTS(left);
+	o.r = ELEMENTS(right);
+	reshape(dst, right);
+	o.d = ELEMENTS(*dst);
+	parallel_for(count, count, subtract_part, &o);
     }
 }
 
+value cupl_add(value left, value right)
+/* add two CUPL values */
+{
+    value	result;
+
+    make_scalar(&result, 0);
+    cupl_add_into(&result, left, right);
+    return(result);
+}
+
+value cupl_subtract(value left, value right)
+/* subtract two CUPL values */
+{
+    value	result;
+
+    make_scalar(&result, 0);
+    cupl_subtract_into(&result, left, right);
+    return(result);
+}
+
 value cupl_multiply(value left, value right)
 /* multiply two CUPL values */
 {
@@ -251,59 +1061,51 @@ value cupl_multiply(value left, value right)
     {
 	value	result;
 
-	make_scalar(&result, 0);
-	result.elements[0] = left.elements[0] * right.elements[0];
+	make_scalar(&result, left.number * right.number);
 	return(result);
     }
     else if (left.width == right.depth)
     {
 	value	result;
-	int	i, j;
 
 	result = allocate_value(2, left.depth, right.width);
-	for (i = 0; i < left.depth; i++)
-	    for (j = 0; j < right.width; j++)
-	    {
-		int k;
-		scalar p = 0;
-
-		for (k = 0; k < left.width; k++)
-		    p += SUB(left, i, k)[0] * SUB(right, k, j)[0];
-
-		SUB(result, i, j)[0] = p;
-	    }
+	matmul(result.elements, ELEMENTS(left), ELEMENTS(right),
+	       left.depth, right.width, left.width);
 	return(result);
     }
     else
 	die("multiplication attempt on non-conformable matrices\n");
 }
 
-value cupl_divide(value left, value right)
-/* divide two CUPL values */
+void cupl_divide_into(value *dst, value left, value right)
+/* divide two CUPL values, leaving the quotient in dst */
 {
-    if (left.rank == 0 && right.rank == 0)
-    {
-	value	result;
-
-	make_scalar(&result, 0);
-	result.elements[0] = left.elements[0] / right.elements[0];
-	return(result);
-    }
-    else if (right.rank == 0)
+    if (right.rank == 0)
     {
-	value	result;
+	scalar	*l = ELEMENTS(left), *d;
+	scalar	divisor = right.number;
 	int	n;
 
-	result = copy_value(left);
+	reshape(dst, left);
+	d = ELEMENTS(*dst);
 	for (n = 0; n < left.width * left.depth; n++)
-	    result.elements[n] = left.elements[n] / right.elements[0];
-	return(result);
+	    d[n] = l[n] / divisor;
     }
     else
 	die("division of rank %d by rank %d value is undefined\n",
 	    left.rank, right.rank);
 }
 
+value cupl_divide(value left, value right)
+/* divide two CUPL values */
+{
+    value	result;
+
+    make_scalar(&result, 0);
+    cupl_divide_into(&result, left, right);
+    return(result);
+}
+
 value cupl_power(value left, value right)
 /* apply power operation with two CUPL values */
 {
@@ -311,23 +1113,42 @@ value cupl_power(value left, value right)
     {
 	value	result;
 
-	make_scalar(&result, 0);
-	result.elements[0] = pow(left.elements[0], right.elements[0]);
+	make_scalar(&result, pow(left.number, right.number));
 	return(result);
     }
     else
 	die("power operation on non-scalars is not yet supported\n");
 }
 
+void cupl_uminus_into(value *dst, value right)
+/* apply unary minus, leaving the result in dst */
+{
+    if (right.rank == 0)
+    {
+	scalar	x = -right.number;
+
+	deallocate_value(dst);
+	make_scalar(dst, x);
+    }
+    else
+    {
+	operands	o;
+	int		count = right.width * right.depth;
+
+	o.r = ELEMENTS(right);
+	reshape(dst, right);
+	o.d = ELEMENTS(*dst);
+	parallel_for(count, count, negate_part, &o);
+    }
+}
+
 value cupl_uminus(value right)
 /* apply unary minus */
 {
-    int	n;
     value	result;
 
-    result = copy_value(right);
-    for (n = 0; n < right.width * right.depth; n++)
-	result.elements[n] = -result.elements[n];
+    make_scalar(&result, 0);
+    cupl_uminus_into(&result, right);
     return(result);
 }
 
@@ -337,15 +1158,35 @@ value cupl_uminus(value right)
  *
  ****************************************************************************/
 
+void cupl_abs_into(value *dst, value right)
+/* apply absolute-value function, leaving the result in dst */
+{
+    if (right.rank == 0)
+    {
+	scalar	x = fabs(right.number);
+
+	deallocate_value(dst);
+	make_scalar(dst, x);
+    }
+    else
+    {
+	operands	o;
+	int		count = right.width * right.depth;
+
+	o.r = ELEMENTS(right);
+	reshape(dst, right);
+	o.d = ELEMENTS(*dst);
+	parallel_for(count, count, abs_part, &o);
+    }
+}
+
 value cupl_abs(value right)
 /* apply absolute-value function */
 {
     value	result;
-    int	n;
 
-    result = copy_value(right);
-    for (n = 0; n < right.width * right.depth; n++)
-	result.elements[n] = fabs(right.elements[n]);
+    make_scalar(&result, 0);
+    cupl_abs_into(&result, right);
     return(result);
 }
 
@@ -358,8 +1199,7 @@ value cupl_atan(value right)
 	die("ATAN is only defined for scalar arguments\n");
     else
     {
-	make_scalar(&result, 0);
-	result.elements[0] = atan(right.elements[0]);
+	make_scalar(&result, atan(right.number));
 	return(result);
     }
 }
@@ -373,8 +1213,7 @@ value cupl_cos(value right)
 	die("COS is only defined for scalar arguments\n");
     else
     {
-	make_scalar(&result, 0);
-	result.elements[0] = cos(right.elements[0]);
+	make_scalar(&result, cos(right.number));
 	return(result);
     }
 }
@@ -388,8 +1227,7 @@ value cupl_exp(value right)
 	die("EXP is only defined for scalar arguments\n");
     else
     {
-	make_scalar(&result, 0);
-	result.elements[0] = exp(right.elements[0]);
+	make_scalar(&result, exp(right.number));
 	return(result);
     }
 }
@@ -403,8 +1241,7 @@ value cupl_floor(value right)
 	die("FLOOR is only defined for scalar arguments\n");
     else
     {
-	make_scalar(&result, 0);
-	result.elements[0] = floor(right.elements[0]);
+	make_scalar(&result, floor(right.number));
 	return(result);
     }
 }
@@ -418,8 +1255,7 @@ value cupl_ln(value right)
 	die("LOG is only defined for scalar arguments\n");
     else
     {
-	make_scalar(&result, 0);
-	result.elements[0] = log(right.elements[0]);
+	make_scalar(&result, log(right.number));
 	return(result);
     }
 }
@@ -433,8 +1269,7 @@ value cupl_log(value right)
 	die("LOG is only defined for scalar arguments\n");
     else
     {
-	make_scalar(&result, 0);
-	result.elements[0] = log10(right.elements[0]);
+	make_scalar(&result, log10(right.number));
 	return(result);
     }
 }
@@ -448,8 +1283,7 @@ value cupl_sqrt(value right)
 	die("SQRT is only defined for scalar arguments\n");
     else
     {
-	make_scalar(&result, 0);
-	result.elements[0] = sqrt(right.elements[0]);
+	make_scalar(&result, sqrt(right.number));
 	return(result);
     }
 }
@@ -460,30 +1294,84 @@ value cupl_sqrt(value right)
  *
  ****************************************************************************/
 
+static void max_part(void *arg, int lo, int hi)
+/* find the largest element in each of a range of blocks */
+{
+    operands	*o = (operands *)arg;
+    int		b, n;
+
+    for (b = lo; b < hi; b++)
+    {
+	scalar	m = o->l[FIRST(b)];
+
+	for (n = FIRST(b); n < LAST(o, b); n++)
+	    if (m < o->l[n])
+		m = o->l[n];
+	o->partial[b] = m;
+    }
+}
+
+static void min_part(void *arg, int lo, int hi)
+/* find the smallest element in each of a range of blocks */
+{
+    operands	*o = (operands *)arg;
+    int		b, n;
+
+    for (b = lo; b < hi; b++)
+    {
+	scalar	m = o->l[FIRST(b)];
+
+	for (n = FIRST(b); n < LAST(o, b); n++)
+	    if (m > o->l[n])
+		m = o->l[n];
+	o->partial[b] = m;
+    }
+}
+
 value cupl_max(value left, value right)
-/* apply max function */
+/* apply max function to all elements of both arguments */
 {
     value	result;
-    int	n;
+    operands	o;
 
-    make_scalar(&result, right.elements[0]);
-    for (n = 0; n < right.width * right.depth; n++)
-	if (result.elements[0] < right.elements[n])
-	    result.elements[0] = right.elements[n];
+    if (left.rank == 0 && right.rank == 0)
+	make_scalar(&result, larger(left.number, right.number));
+    else
+    {
+	scalar	l, r;
+
+	o.l = ELEMENTS(left);
+	o.count = left.width * left.depth;
+	l = reduce(&o, max_part, larger);
+	o.l = ELEMENTS(right);
+	o.count = right.width * right.depth;
+	r = reduce(&o, max_part, larger);
+	make_scalar(&result, larger(l, r));
+    }
 
     return(result);
 }
 
 value cupl_min(value left, value right)
-/* apply min functionnot yet supported for vectors and matrices */
+/* apply min function to all elements of both arguments */
 {
     value	result;
-    int	n;
+    operands	o;
 
-    make_scalar(&result, right.elements[0]);
-    for (n = 0; n < right.width * right.depth; n++)
-	if (result.elements[0] > right.elements[n])
-	    result.elements[0] = right.elements[n];
+    if (left.rank == 0 && right.rank == 0)
+	make_scalar(&result, smaller(left.number, right.number));
+    else
+    {
+	scalar	l, r;
+
+	o.l = ELEMENTS(left);
+	o.count = left.width * left.depth;
+	l = reduce(&o, min_part, smaller);
+	o.l = ELEMENTS(right);
+	o.count = right.width * right.depth;
+	r = reduce(&o, min_part, smaller);
+	make_scalar(&result, smaller(l, r));
+    }
 
     return(result);
 }
@@ -497,9 +1385,8 @@ value cupl_rand(value right)
 	die("RAND is only defined for scalar arguments\n");
     else
     {
-	make_scalar(&result, 0);
-	srand(right.elements[0]);
-	result.elements[0] = rand();
+	srand(right.number);
+	make_scalar(&result, rand());
 	return(result);
     }
 }
@@ -514,8 +1401,6 @@ value cupl_rand(value right)
  * Original CUPL's roundoff rule for relations seems to have been designed
  * to throw away all digits of precision more than 14,
  */
-#define FUZZY_EQUAL(m, n)	(fabs((m) - (n)) < 10e-15)
-
 bool cupl_eq(value v1, value v2)
 /* test any two CUPL values for pairwise equality */
 {
@@ -523,17 +1408,9 @@ bool cupl_eq(value v1, value v2)
 	die("comparison failed, operands of different sizes or ranks\n");
     else
     {
-	int	n;
-
-	for (n = 0; n < v2.width * v2.depth; n++)
-	{
-	    scalar e1 = v1.elements[n], e2 = v2.elements[n];
-
-	    if (!FUZZY_EQUAL(e1, e2))
-		return(false);
-	}
-
-	return(true);
+	if (v2.rank == 0)
+	    return(FUZZY_EQUAL(v1.number, v2.number));
+	return(vec_all_eq(v1.elements, v2.elements, (long)v2.width * v2.depth));
     }
 }
 
@@ -544,19 +1421,9 @@ bool cupl_le(value v1, value v2)
 	die("LE failed, operands of different sizes or ranks\n");
     else
     {
-	bool equal = true;
-	int	n;
-
-
-	for (n = 0; n < v2.width * v2.depth; n++)
-	{
-	    scalar e1 = v1.elements[n], e2 = v2.elements[n];
-
-	    if (!FUZZY_EQUAL(e1, e2) && e1 > e2)
-		return(false);
-	}
-
-	return(true);
+	if (v2.rank == 0)
+	    return(FUZZY_EQUAL(v1.number, v2.number) || !(v1.number > v2.number));
+	return(vec_all_le(v1.elements, v2.elements, (long)v2.width * v2.depth));
     }
 }
 
@@ -567,17 +1434,9 @@ bool cupl_ge(value v1, value v2)
 	die("GE failed, operands of different sizes or ranks\n");
     else
     {
-	int	n;
-
-	for (n = 0; n < v2.width * v2.depth; n++)
-	{
-	    scalar e1 = v1.elements[n], e2 = v2.elements[n];
-
-	    if (!FUZZY_EQUAL(e1, e2) && e1 < e2)
-		return(false);
-	}
-
-	return(true);
+	if (v2.rank == 0)
+	    return(FUZZY_EQUAL(v1.number, v2.number) || !(v1.number < v2.number));
+	return(vec_all_ge(v1.elements, v2.elements, (long)v2.width * v2.depth));
     }
 }
 
@@ -599,10 +1458,59 @@ bool cupl_gt(value v1, value v2)
  *
  ****************************************************************************/
 
+static scalar *factor(value right, int **piv, int *sign, const char *fn)
+/* LU-factor a copy of a square matrix's elements */
+{
+    int		n = right.width;
+    scalar	*a;
+
+    if (right.rank != 2 || right.width != right.depth)
+	die("%s failed, operand is not a square matrix\n", fn);
+    if ((a = (scalar *)malloc(sizeof(scalar) * n * n)) == (scalar *)NULL
+	|| (*piv = (int *)malloc(sizeof(int) * n)) == (int *)NULL)
+	die(NOMEM);
+    memcpy(a, right.elements, sizeof(scalar) * n * n);
+    *sign = lu_factor(a, n, *piv);
+    return(a);
+}
+
 value cupl_det(value right)
+/* compute the determinant of a matrix */
+{
+    value	result;
+    scalar	*a;
+    int		*piv, sign, n;
+
+    if (right.rank == 0)
+    {
+	make_scalar(&result, right.number);
+	return(result);
+    }
+
+    a = factor(right, &piv, &sign, "DET");
+    make_scalar(&result, sign);
+    if (sign != 0)
+	for (n = 0; n < right.width; n++)
+	    result.number *= a[n * right.width + n];
+    free(a);
+    free(piv);
+    return(result);
+}
+
+static void dot_part(void *arg, int lo, int hi)
+/* sum products over each of a range of blocks */
 {
-    /* FIXME: implement DET */
-    die("the determinant function is not yet implemented");
+    operands	*o = (operands *)arg;
+    int		b, n;
+
+    for (b = lo; b < hi; b++)
+    {
+	scalar	sum = 0;
+
+	for (n = FIRST(b); n < LAST(o, b); n++)
+	    sum += o->l[n] * o->r[n];
+	o->partial[b] = sum;
+    }
 }
 
 value cupl_dot(value left, value right)
@@ -612,12 +1520,13 @@ value cupl_dot(value left, value right)
 	die("DOT failed, operands of different sizes or ranks\n");
     else
     {
-	value	result;
-	int	n;
+	value		result;
+	operands	o;
 
-	make_scalar(&result, 0);
-	for (n = 0; n < left.width * left.depth; n++)
-	    result.elements[0] += left.elements[n] * right.elements[n];
+	o.l = left.elements;
+	o.r = right.elements;
+	o.count = left.width * left.depth;
+	make_scalar(&result, reduce(&o, dot_part, plus));
 	return(result);
     }
 }
@@ -625,8 +1534,26 @@ value cupl_dot(value left, value right)
 value cupl_inv(value right)
 /* compute the inverse of a matrix */
 {
-    /* FIXME: implement INV */
-    die("the inverse function is not yet implemented\n");
+    value	result;
+    scalar	*a;
+    int		*piv, sign;
+
+    if (right.rank == 0)
+    {
+	if (right.number == 0)
+	    die("INV failed, matrix is singular\n");
+	make_scalar(&result, 1 / right.number);
+	return(result);
+    }
+
+    a = factor(right, &piv, &sign, "INV");
+    if (sign == 0)
+	die("INV failed, matrix is singular\n");
+    result = allocate_value(2, right.depth, right.width);
+    lu_invert(a, right.width, piv, result.elements);
+    free(a);
+    free(piv);
+    return(result);
 }
 
 value cupl_posmax(value right)
@@ -644,7 +1571,7 @@ value cupl_posmax(value right)
 	for (n = 0; n < right.width * right.depth; n++)
 	    if (maxel < right.elements[n])
 	    {
-		result.elements[0] = SUBI(right, n);
+		result.number = SUBI(right, n);
 		maxel = right.elements[0];
 	    }
 
@@ -667,7 +1594,7 @@ value cupl_posmin(value right)
 	for (n = 0; n < right.width * right.depth; n++)
 	    if (minel > right.elements[n])
 	    {
-		result.elements[0] = SUBI(right, n);
+		result.number = SUBI(right, n);
 		minel = right.elements[n];
 	    }
 
@@ -675,15 +1602,31 @@ value cupl_posmin(value right)
     }
 }
 
+static void sgm_part(void *arg, int lo, int hi)
+/* sum magnitudes over each of a range of blocks */
+{
+    operands	*o = (operands *)arg;
+    int		b, n;
+
+    for (b = lo; b < hi; b++)
+    {
+	scalar	sum = 0;
+
+	for (n = FIRST(b); n < LAST(o, b); n++)
+	    sum += fabs(o->l[n]);
+	o->partial[b] = sum;
+    }
+}
+
 value cupl_sgm(value right)
 /* compute the sum of the elements of a matrix */
 {
-    value result;
-    int	n;
+    value	result;
+    operands	o;
 
-    make_scalar(&result, 0);
-    for (n = 0; n < right.width * right.depth; n++)
-	result.elements[0] += fabs(right.elements[n]);
+    o.l = ELEMENTS(right);
+    o.count = right.width * right.depth;
+    make_scalar(&result, reduce(&o, sgm_part, plus));
     return(result);
 }
 
@@ -699,20 +1642,33 @@ value cupl_trc(value right)
 
 	make_scalar(&result, 0);
 	for (n = 0; n < right.width; n++)
-	    result.elements[0] += SUB(right, n, n)[0];
+	    result.number += SUB(right, n, n)[0];
 	return(result);
     }
 }
 
+static void trn_part(void *arg, int lo, int hi)
+/* transpose a range of rows */
+{
+    operands	*o = (operands *)arg;
+    int		i, j;
+
+    for (i = lo; i < hi; i++)
+	for (j = 0; j < o->width; j++)
+	    o->d[j * o->depth + i] = o->r[i * o->width + j];
+}
+
 value cupl_trn(value right)
 /* compute the transpose of a matrix */
 {
-    value result = allocate_value(right.rank, right.depth, right.width);
-    int	i, j;
-
-    for (i = 0; i < right.depth; i++)
-	for (j = 0; j < right.width; j++)
-	    SUB(result, j, i)[0] = SUB(right, i, j)[0];
+    value	result = allocate_value(right.rank, right.width, right.depth);
+    operands	o;
+
+    o.d = ELEMENTS(result);
+    o.r = ELEMENTS(right);
+    o.width = right.width;
+    o.depth = right.depth;
+    parallel_for(right.depth, (long)right.width * right.depth, trn_part, &o);
 
     return(result);
 }
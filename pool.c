@@ -0,0 +1,148 @@
+/*****************************************************************************
+
+NAME
+   pool.c -- persistent worker threads for the heavy intrinsics
+
+SYNOPSIS
+   void pool_threads(int n)		-- set the number of threads to use
+   void parallel_for(int n, long work,
+		     void (*fn)(void *arg, int lo, int hi), void *arg)
+					-- run fn over [0, n) in parallel
+
+DESCRIPTION
+   parallel_for() splits the index range [0, n) into one contiguous
+piece per thread and calls fn on each piece, the calling thread taking
+the first; it returns when all pieces are done.  work is the caller's
+estimate of the total cost in element operations.  Below PARALLEL_MIN
+the whole range is done serially in the caller, so small values never
+pay for a thread handoff.
+
+   The workers are started the first time they are needed and then
+sleep between jobs.  Only the main thread may call parallel_for(), and
+fn must not call it again.  The workers block SIGPROF, so the profiler's
+ticks, which count their CPU time too, are always taken by the main
+thread.
+
+LICENSE
+   SPDX-License-Identifier: BSD-2-clause
+
+*****************************************************************************/
+/*LINTLIBRARY*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <signal.h>
+#include <pthread.h>
+#include "cupl.h"
+
+#define PARALLEL_MIN	(1L << 17)	/* least work worth splitting */
+
+static int nthreads = 1;	/* threads to use, counting the caller */
+static int nworkers;		/* worker threads started */
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t finished = PTHREAD_COND_INITIALIZER;
+
+/* the current job; all of this is guarded by lock */
+static void (*job)(void *, int, int);
+static void *jobarg;
+static int jobsize;		/* index range is [0, jobsize) */
+static int nparts;		/* pieces the range is cut into */
+static int pending;		/* worker pieces not yet finished */
+static unsigned long generation;	/* bumped for each new job */
+
+void pool_threads(int n)
+/* set the number of threads to use, including the main one */
+{
+    nthreads = (n < 1) ? 1 : n;
+}
+
+static void run_part(int part)
+/* do one piece of the current job */
+{
+    int	lo = (long)jobsize * part / nparts;
+    int	hi = (long)jobsize * (part + 1) / nparts;
+
+    if (lo < hi)
+	job(jobarg, lo, hi);
+}
+
+static void *worker(void *arg)
+/* wait for jobs and do our piece of each */
+{
+    int			id = (int)(intptr_t)arg;
+    unsigned long	seen = 0;
+
+    (void) pthread_mutex_lock(&lock);
+    for (;;)
+    {
+	while (generation == seen)
+	    (void) pthread_cond_wait(&wake, &lock);
+	seen = generation;
+
+	if (id < nparts)
+	{
+	    (void) pthread_mutex_unlock(&lock);
+	    run_part(id);
+	    (void) pthread_mutex_lock(&lock);
+	    if (--pending == 0)
+		(void) pthread_cond_signal(&finished);
+	}
+    }
+    /* NOTREACHED */
+    return((void *)NULL);
+}
+
+static void start_workers(void)
+/* start the worker threads */
+{
+    sigset_t	prof, old;
+
+    /* threads inherit the signal mask they are created with */
+    (void) sigemptyset(&prof);
+    (void) sigaddset(&prof, SIGPROF);
+    (void) pthread_sigmask(SIG_BLOCK, &prof, &old);
+    for (nworkers = 0; nworkers < nthreads - 1; nworkers++)
+    {
+	pthread_t	tid;
+
+	if (pthread_create(&tid, (pthread_attr_t *)NULL,
+			   worker, (void *)(intptr_t)(nworkers + 1)) != 0)
+	    break;
+	(void) pthread_detach(tid);
+    }
+    (void) pthread_sigmask(SIG_SETMASK, &old, (sigset_t *)NULL);
+}
+
+void parallel_for(int n, long work, void (*fn)(void *, int, int), void *arg)
+/* call fn on pieces of [0, n), in parallel if there is enough work */
+{
+    if (nthreads <= 1 || n < 2 || work < PARALLEL_MIN)
+    {
+	fn(arg, 0, n);
+	return;
+    }
+
+    if (nworkers == 0)
+	start_workers();
+
+    (void) pthread_mutex_lock(&lock);
+    job = fn;
+    jobarg = arg;
+    jobsize = n;
+    nparts = (n < nworkers + 1) ? n : nworkers + 1;
+    pending = nparts - 1;
+    generation++;
+    (void) pthread_cond_broadcast(&wake);
+    (void) pthread_mutex_unlock(&lock);
+
+    run_part(0);
+
+    (void) pthread_mutex_lock(&lock);
+    while (pending > 0)
+	(void) pthread_cond_wait(&finished, &lock);
+    (void) pthread_mutex_unlock(&lock);
+}
+
+/* pool.c ends here */
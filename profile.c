@@ -0,0 +1,514 @@
+/*****************************************************************************
+
+NAME
+   profile.c -- statement and block profiling for cupl -p and -P
+
+SYNOPSIS
+   void profile_start(node *tree)	-- get ready to profile a program
+   void profile_statement(node *sp)	-- a statement is starting
+   void profile_call(node *target)	-- a PERFORM is starting
+   void profile_return(void)		-- and has finished
+   void profile_report(void)		-- write the reports and clean up
+
+DESCRIPTION
+   With -p the interpreter tells this module as each statement starts
+and each PERFORM begins and ends.  A statement is charged with the time
+from its start to the start of the next one, less any PERFORMs it makes,
+and with its count of executions; a block is charged with the time from
+each PERFORM of it to the matching return, including the blocks it
+performs in turn but counted only once when it performs itself.  Times
+come from the monotonic clock, read once per event, so the run is slowed
+by a small constant per statement.  The cost of reading it is measured
+at the start and taken off each interval, so that the times are those
+of the unprofiled run as nearly as may be.
+
+   The report goes to standard error when the program finishes: the
+statements that ran, hottest first, with their source lines, then the
+blocks.  Statements that -O added to hoist invariant arithmetic share
+the number of the statement they were hoisted to, and their time is
+charged to it.
+
+   With -P the interpreter only tells this module as each PERFORM begins
+and ends, and native code stays on, so statements cost nothing extra.
+An interval timer on the CPU time the process uses raises SIGPROF every
+SAMPLE_US microseconds, and the handler only counts the tick.  At the
+next PERFORM or return the ticks are credited to the stack of blocks
+being PERFORMed, which cannot have changed in between.  Work handed to
+the worker threads is counted too; they block SIGPROF, so the ticks are
+always taken here.  When the program finishes each distinct stack goes
+to the named file as a line of block names separated by semicolons,
+followed by its count of ticks: the collapsed form that flame graph
+scripts take.  With -p as well, the ticks are also credited at each
+statement, and the line of the statement running ends each stack.
+
+LICENSE
+   SPDX-License-Identifier: BSD-2-clause
+
+*****************************************************************************/
+/*LINTLIBRARY*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <sys/time.h>
+#include "cupl.h"
+#include "tokens.h"
+
+#define CALLS		64	/* PERFORMs in progress allowed for at first */
+#define SAMPLES		256	/* distinct stacks allowed for at first */
+#define SAMPLE_US	1000	/* microseconds of CPU time between samples */
+
+typedef struct
+{
+    long	count;		/* executions or PERFORMs */
+    uint64_t	ns;		/* time charged */
+}
+tally;
+
+typedef struct
+{
+    int		block;		/* number of the block's first statement */
+    int		caller;		/* statement that made the PERFORM */
+    uint64_t	start;		/* when it did */
+    long	events;		/* events before it */
+}
+call;
+
+typedef struct
+{
+    int		*frames;	/* block numbers, then the statement's */
+    int		depth;		/* count of frames; 0 if the slot is empty */
+    long	ticks;		/* samples that found this stack */
+}
+sample;
+
+static int nstatements;		/* highest statement number, plus one */
+static node **statements;	/* statement nodes, by number */
+static char **labels;		/* statement labels, by number */
+static char **names;		/* block labels, by first statement number */
+static tally *stmts, *blocks;	/* by number */
+static int *active;		/* activations of each block, by number */
+
+static call *calls;		/* PERFORMs in progress */
+static int ncalls, maxcalls;
+
+static int current;		/* number of the statement running */
+static uint64_t last;		/* when it, or its PERFORM, last resumed */
+static long events;		/* statements, PERFORMs and returns seen */
+static uint64_t overhead;	/* nanoseconds each event costs */
+
+static atomic_long ticks;	/* samples not yet credited */
+static sample *samples;		/* open-addressed, by stack */
+static size_t samplesize;	/* slots, always a power of 2 */
+static size_t nsamples;		/* slots in use */
+static FILE *samplefp;		/* where the stacks go */
+
+/****************************************************************************
+ *
+ * Timing
+ *
+ ****************************************************************************/
+
+static uint64_t now(void)
+/* the monotonic clock in nanoseconds */
+{
+    struct timespec	ts;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+    return((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+static uint64_t since(uint64_t t)
+/* the time from the last event to t, less the cost of noting it */
+{
+    uint64_t	d = t - last;
+
+    last = t;
+    events++;
+    return((d > overhead) ? d - overhead : 0);
+}
+
+static const tally *sorting;	/* the tallies being sorted */
+
+static int hotter(const void *a, const void *b)
+/* order statement or block numbers by time charged, most first */
+{
+    const tally	*x = &sorting[*(const int *)a], *y = &sorting[*(const int *)b];
+
+    if (x->ns != y->ns)
+	return((x->ns < y->ns) ? 1 : -1);
+    return(*(const int *)a - *(const int *)b);
+}
+
+static int hottest(const tally *t, int *order)
+/* fill order with the numbers that ran, hottest first; return the count */
+{
+    int		n, count = 0;
+
+    for (n = 1; n < nstatements; n++)
+	if (t[n].count)
+	    order[count++] = n;
+    sorting = t;
+    qsort(order, count, sizeof(int), hotter);
+    return(count);
+}
+
+static double percent(uint64_t part, uint64_t whole)
+{
+    return(whole ? 100.0 * part / whole : 0.0);
+}
+
+static void report_times(void)
+/* write the hot spots to standard error */
+{
+    int		*order, count, n;
+    uint64_t	total = 0;
+    long	executed = 0;
+
+    stmts[current].ns += since(now());
+    for (n = 0; n < nstatements; n++)
+    {
+	total += stmts[n].ns;
+	executed += stmts[n].count;
+    }
+    if ((order = (int *)malloc(sizeof(int) * nstatements)) == (int *)NULL)
+	die(NOMEM);
+
+    (void) fprintf(stderr, "\nProfile: %ld statements in %.6f seconds\n\n",
+		   executed, total / 1e9);
+    (void) fprintf(stderr, "  line  stmt  label          count      seconds      %%\n");
+    count = hottest(stmts, order);
+    for (n = 0; n < count; n++)
+	(void) fprintf(stderr, "%6d %5d  %-8s %12ld %12.6f %6.1f\n",
+		       statements[order[n]]->line, order[n],
+		       labels[order[n]] ? labels[order[n]] : "",
+		       stmts[order[n]].count, stmts[order[n]].ns / 1e9,
+		       percent(stmts[order[n]].ns, total));
+
+    count = hottest(blocks, order);
+    if (count > 0)
+    {
+	(void) fprintf(stderr, "\n  line  block       performs      seconds      %%\n");
+	for (n = 0; n < count; n++)
+	    (void) fprintf(stderr, "%6d  %-8s %13ld %12.6f %6.1f\n",
+			   statements[order[n]]->line,
+			   names[order[n]] ? names[order[n]] : "",
+			   blocks[order[n]].count, blocks[order[n]].ns / 1e9,
+			   percent(blocks[order[n]].ns, total));
+    }
+
+    free(order);
+}
+
+/****************************************************************************
+ *
+ * Sampling
+ *
+ ****************************************************************************/
+
+static void tick(int sig)
+/* SIGPROF handler; anything more can wait for the next event */
+{
+    (void) sig;
+    ticks++;
+}
+
+static size_t hash_frames(const int *frames, int depth)
+/* FNV-1a hash of a stack */
+{
+    size_t	h = 2166136261u;
+
+    while (depth--)
+	h = (h ^ (unsigned)*frames++) * 16777619u;
+    return(h);
+}
+
+static size_t hash_stack(void)
+/* the same hash of the PERFORMs in progress and the current statement */
+{
+    size_t	h = 2166136261u;
+    int		n;
+
+    for (n = 0; n < ncalls; n++)
+	h = (h ^ (unsigned)calls[n].block) * 16777619u;
+    return((h ^ (unsigned)current) * 16777619u);
+}
+
+static bool same_stack(const sample *sp)
+/* is this the stack we are in now? */
+{
+    int		n;
+
+    if (sp->depth != ncalls + 1 || sp->frames[ncalls] != current)
+	return(false);
+    for (n = 0; n < ncalls; n++)
+	if (sp->frames[n] != calls[n].block)
+	    return(false);
+    return(true);
+}
+
+static void grow_samples(void)
+/* double the stack table, rehashing what it holds */
+{
+    sample	*old = samples;
+    size_t	oldsize = samplesize, n, h;
+
+    samplesize = samplesize ? samplesize * 2 : SAMPLES;
+    if ((samples = (sample *)calloc(samplesize, sizeof(sample))) == (sample *)NULL)
+	die(NOMEM);
+    for (n = 0; n < oldsize; n++)
+	if (old[n].depth)
+	{
+	    h = hash_frames(old[n].frames, old[n].depth) & (samplesize - 1);
+	    while (samples[h].depth)
+		h = (h + 1) & (samplesize - 1);
+	    samples[h] = old[n];
+	}
+    free(old);
+}
+
+static void credit(void)
+/* credit the ticks since the last event to the stack we are in */
+{
+    sample	*sp;
+    size_t	h;
+    int		n;
+
+    if (4 * (nsamples + 1) > 3 * samplesize)
+	grow_samples();
+    for (h = hash_stack() & (samplesize - 1); samples[h].depth; h = (h + 1) & (samplesize - 1))
+	if (same_stack(&samples[h]))
+	    break;
+
+    sp = &samples[h];
+    if (sp->depth == 0)
+    {
+	sp->depth = ncalls + 1;
+	if ((sp->frames = (int *)malloc(sizeof(int) * sp->depth)) == (int *)NULL)
+	    die(NOMEM);
+	for (n = 0; n < ncalls; n++)
+	    sp->frames[n] = calls[n].block;
+	sp->frames[ncalls] = current;
+	nsamples++;
+    }
+    sp->ticks += atomic_exchange(&ticks, 0);
+}
+
+static void sample_timer(int us)
+/* start the interval timer, or stop it if us is 0 */
+{
+    struct itimerval	it;
+
+    it.it_interval.tv_sec = it.it_value.tv_sec = 0;
+    it.it_interval.tv_usec = it.it_value.tv_usec = us;
+    (void) setitimer(ITIMER_PROF, &it, (struct itimerval *)NULL);
+}
+
+static void write_samples(void)
+/* write each stack sampled in collapsed form, and forget them */
+{
+    size_t	h;
+    int		n, f;
+
+    for (h = 0; h < samplesize; h++)
+    {
+	sample	*sp = &samples[h];
+
+	if (sp->depth == 0)
+	    continue;
+	(void) fputs("(program)", samplefp);
+	for (n = 0; n < sp->depth - 1; n++)
+	    if (names[f = sp->frames[n]])
+		(void) fprintf(samplefp, ";%s", names[f]);
+	    else
+		(void) fprintf(samplefp, ";line %d", statements[f]->line);
+	if ((f = sp->frames[n]) != 0)
+	    (void) fprintf(samplefp, ";line %d", statements[f]->line);
+	(void) fprintf(samplefp, " %ld\n", sp->ticks);
+	free(sp->frames);
+    }
+    (void) fflush(samplefp);
+
+    free(samples);
+    samples = (sample *)NULL;
+    samplesize = nsamples = 0;
+}
+
+/****************************************************************************
+ *
+ * Entry points
+ *
+ ****************************************************************************/
+
+void profile_start(node *tree)
+/* get ready to profile a program */
+{
+    node	*np;
+    lvar	*lp;
+    int		n;
+
+    nstatements = 1;
+    for_cdr(np, tree)
+	if (np->number >= nstatements)
+	    nstatements = np->number + 1;
+
+    statements = (node **)calloc(nstatements, sizeof(node *));
+    labels = (char **)calloc(nstatements, sizeof(char *));
+    names = (char **)calloc(nstatements, sizeof(char *));
+    stmts = (tally *)calloc(nstatements, sizeof(tally));
+    blocks = (tally *)calloc(nstatements, sizeof(tally));
+    active = (int *)calloc(nstatements, sizeof(int));
+    if (statements == (node **)NULL || labels == (char **)NULL
+	|| names == (char **)NULL
+	|| stmts == (tally *)NULL || blocks == (tally *)NULL
+	|| active == (int *)NULL)
+	die(NOMEM);
+
+    /* hoisted statements follow the one they were hoisted to */
+    for_cdr(np, tree)
+	if (statements[np->number] == NULLNODE)
+	    statements[np->number] = np;
+
+    /* the labels are gone from the tree, but not from the symbols */
+    for_symbols(lp)
+	if (lp->target && lp->target->type == STATEMENT)
+	{
+	    if (lp->blabeldef)
+		names[lp->target->number] = lp->node->u.string;
+	    else if (lp->slabeldef)
+		labels[lp->target->number] = lp->node->u.string;
+	}
+
+    ncalls = current = 0;
+    events = 0;
+
+    if (samplefile)
+    {
+	struct sigaction	sa;
+
+	if (samplefp == (FILE *)NULL
+	    && (samplefp = fopen(samplefile, "w")) == (FILE *)NULL)
+	    die("can't open sample file %s\n", samplefile);
+	grow_samples();
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = tick;
+	sa.sa_flags = SA_RESTART;
+	(void) sigemptyset(&sa.sa_mask);
+	(void) sigaction(SIGPROF, &sa, (struct sigaction *)NULL);
+	ticks = 0;
+	sample_timer(SAMPLE_US);
+    }
+
+    /* each event reads the clock once; that much of each interval is ours */
+    if (profiling)
+    {
+	last = now();
+	for (n = 0; n < 1000; n++)
+	    (void) now();
+	overhead = (now() - last) / 1000;
+	last = now();
+    }
+}
+
+void profile_statement(node *sp)
+/* charge the statement that was running, and start on sp */
+{
+    /* the rest of a statement -O has hoisted arithmetic into */
+    if (statements[sp->number] != sp)
+	return;
+
+    if (ticks)
+	credit();
+    if (profiling)
+    {
+	stmts[current].ns += since(now());
+	stmts[sp->number].count++;
+    }
+    current = sp->number;
+}
+
+void profile_call(node *target)
+/* a PERFORM of the block starting at target */
+{
+    uint64_t	t = 0;
+    call	*cp;
+
+    if (ticks)
+	credit();
+    if (ncalls >= maxcalls)
+    {
+	maxcalls = maxcalls ? maxcalls * 2 : CALLS;
+	calls = (call *)realloc(calls, sizeof(call) * maxcalls);
+	if (calls == (call *)NULL)
+	    die(NOMEM);
+    }
+    if (profiling)
+	stmts[current].ns += since(t = now());
+
+    cp = &calls[ncalls++];
+    cp->block = target ? target->number : 0;
+    cp->caller = current;
+    cp->start = t;
+    cp->events = events;
+    blocks[cp->block].count++;
+    active[cp->block]++;
+}
+
+void profile_return(void)
+/* the innermost PERFORM has finished */
+{
+    uint64_t	t = 0, spent, ours;
+    call	*cp;
+
+    /* the main program finishes like a block, but wasn't performed */
+    if (ncalls == 0)
+	return;
+
+    if (ticks)
+	credit();
+    if (profiling)
+	stmts[current].ns += since(t = now());
+
+    cp = &calls[--ncalls];
+    if (--active[cp->block] == 0 && profiling)
+    {
+	spent = t - cp->start;
+	ours = (events - cp->events) * overhead;
+	blocks[cp->block].ns += (spent > ours) ? spent - ours : 0;
+    }
+    current = cp->caller;
+}
+
+void profile_report(void)
+/* write the reports asked for, and free everything */
+{
+    if (samplefile)
+    {
+	sample_timer(0);
+	if (ticks)
+	    credit();
+	write_samples();
+    }
+
+    /* a STOP may come from inside PERFORMs */
+    while (ncalls > 0)
+	profile_return();
+    if (profiling)
+	report_times();
+
+    free(statements);
+    free(labels);
+    free(names);
+    free(stmts);
+    free(blocks);
+    free(active);
+    free(calls);
+    calls = (call *)NULL;
+    maxcalls = 0;
+}
+
+/* profile.c ends here */
@@ -0,0 +1,326 @@
+/*****************************************************************************
+
+NAME
+   simd.c -- elementwise kernels
+
+SYNOPSIS
+   void vec_add(scalar *d, const scalar *l, const scalar *r, long n)
+   void vec_subtract(scalar *d, const scalar *l, const scalar *r, long n)
+   void vec_negate(scalar *d, const scalar *r, long n)
+   void vec_abs(scalar *d, const scalar *r, long n)
+
+   bool vec_all_eq(const scalar *l, const scalar *r, long n)
+   bool vec_all_le(const scalar *l, const scalar *r, long n)
+   bool vec_all_ge(const scalar *l, const scalar *r, long n)
+
+DESCRIPTION
+   The inner loops of the elementwise intrinsics.  The arithmetic
+kernels store their results in d, which may be the same array as an
+operand.  The comparisons apply CUPL's fuzzy equality (FUZZY_EQUAL in
+cupl.h) element by element: vec_all_le() is true unless some element
+of l is greater than, and not fuzzily equal to, its correspondent in r.
+They give up at the first block containing a failing element.
+
+   On x86-64 processors with AVX2 the kernels work four elements at a
+time and the comparisons build their masks a block of sixteen at a
+time; the choice is made once, at the first call.  Otherwise plain
+loops are used.  Both give exactly the same results.
+
+LICENSE
+   SPDX-License-Identifier: BSD-2-clause
+
+*****************************************************************************/
+/*LINTLIBRARY*/
+#include <stdio.h>
+#include <math.h>
+#include "cupl.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define HAVE_AVX2_KERNELS
+#endif /* defined(__GNUC__) && defined(__x86_64__) */
+
+typedef struct
+{
+    void	(*add)(scalar *, const scalar *, const scalar *, long);
+    void	(*subtract)(scalar *, const scalar *, const scalar *, long);
+    void	(*negate)(scalar *, const scalar *, long);
+    void	(*abs)(scalar *, const scalar *, long);
+    bool	(*all_eq)(const scalar *, const scalar *, long);
+    bool	(*all_le)(const scalar *, const scalar *, long);
+    bool	(*all_ge)(const scalar *, const scalar *, long);
+}
+kernels;
+
+/****************************************************************************
+ *
+ * Portable kernels
+ *
+ ****************************************************************************/
+
+static void add_portable(scalar *d, const scalar *l, const scalar *r, long n)
+{
+    long	i;
+
+    for (i = 0; i < n; i++)
+	d[i] = l[i] + r[i];
+}
+
+static void subtract_portable(scalar *d, const scalar *l, const scalar *r, long n)
+{
+    long	i;
+
+    for (i = 0; i < n; i++)
+	d[i] = l[i] - r[i];
+}
+
+static void negate_portable(scalar *d, const scalar *r, long n)
+{
+    long	i;
+
+    for (i = 0; i < n; i++)
+	d[i] = -r[i];
+}
+
+static void abs_portable(scalar *d, const scalar *r, long n)
+{
+    long	i;
+
+    for (i = 0; i < n; i++)
+	d[i] = fabs(r[i]);
+}
+
+static bool all_eq_portable(const scalar *l, const scalar *r, long n)
+{
+    long	i;
+
+    for (i = 0; i < n; i++)
+	if (!FUZZY_EQUAL(l[i], r[i]))
+	    return(false);
+    return(true);
+}
+
+static bool all_le_portable(const scalar *l, const scalar *r, long n)
+{
+    long	i;
+
+    for (i = 0; i < n; i++)
+	if (!FUZZY_EQUAL(l[i], r[i]) && l[i] > r[i])
+	    return(false);
+    return(true);
+}
+
+static bool all_ge_portable(const scalar *l, const scalar *r, long n)
+{
+    long	i;
+
+    for (i = 0; i < n; i++)
+	if (!FUZZY_EQUAL(l[i], r[i]) && l[i] < r[i])
+	    return(false);
+    return(true);
+}
+
+static const kernels portable =
+{
+    add_portable, subtract_portable, negate_portable, abs_portable,
+    all_eq_portable, all_le_portable, all_ge_portable,
+};
+
+/****************************************************************************
+ *
+ * AVX2 kernels
+ *
+ ****************************************************************************/
+
+#ifdef HAVE_AVX2_KERNELS
+#define AVX2	__attribute__((target("avx2")))
+
+AVX2 static void add_avx2(scalar *d, const scalar *l, const scalar *r, long n)
+{
+    long	i;
+
+    for (i = 0; i + 4 <= n; i += 4)
+	_mm256_storeu_pd(d + i, _mm256_add_pd(_mm256_loadu_pd(l + i),
+					      _mm256_loadu_pd(r + i)));
+    add_portable(d + i, l + i, r + i, n - i);
+}
+
+AVX2 static void subtract_avx2(scalar *d, const scalar *l, const scalar *r, long n)
+{
+    long	i;
+
+    for (i = 0; i + 4 <= n; i += 4)
+	_mm256_storeu_pd(d + i, _mm256_sub_pd(_mm256_loadu_pd(l + i),
+					      _mm256_loadu_pd(r + i)));
+    subtract_portable(d + i, l + i, r + i, n - i);
+}
+
+AVX2 static void negate_avx2(scalar *d, const scalar *r, long n)
+{
+    __m256d	sign = _mm256_set1_pd(-0.0);
+    long	i;
+
+    for (i = 0; i + 4 <= n; i += 4)
+	_mm256_storeu_pd(d + i, _mm256_xor_pd(_mm256_loadu_pd(r + i), sign));
+    negate_portable(d + i, r + i, n - i);
+}
+
+AVX2 static void abs_avx2(scalar *d, const scalar *r, long n)
+{
+    __m256d	sign = _mm256_set1_pd(-0.0);
+    long	i;
+
+    for (i = 0; i + 4 <= n; i += 4)
+	_mm256_storeu_pd(d + i, _mm256_andnot_pd(sign, _mm256_loadu_pd(r + i)));
+    abs_portable(d + i, r + i, n - i);
+}
+
+/*
+ * The comparisons gather a mask of failing lanes over a block of four
+ * vectors and only then test it, so the early exit costs one branch per
+ * sixteen elements.  A lane fails equality unless |l - r| < FUZZ, which
+ * is false for NaNs just as in FUZZY_EQUAL; it fails LE (GE) if it is
+ * not equal and l > r (l < r), using ordered compares so NaNs never do.
+ */
+#define BLOCK	16
+
+AVX2 static inline __m256d unequal(__m256d l, __m256d r)
+/* lanes where l and r are not fuzzily equal */
+{
+    __m256d	diff = _mm256_andnot_pd(_mm256_set1_pd(-0.0), _mm256_sub_pd(l, r));
+
+    return(_mm256_cmp_pd(diff, _mm256_set1_pd(FUZZ), _CMP_NLT_UQ));
+}
+
+AVX2 static bool all_eq_avx2(const scalar *l, const scalar *r, long n)
+{
+    long	i, j;
+
+    for (i = 0; i + BLOCK <= n; i += BLOCK)
+    {
+	__m256d	fail = _mm256_setzero_pd();
+
+	for (j = i; j < i + BLOCK; j += 4)
+	    fail = _mm256_or_pd(fail, unequal(_mm256_loadu_pd(l + j),
+					      _mm256_loadu_pd(r + j)));
+	if (_mm256_movemask_pd(fail))
+	    return(false);
+    }
+    return(all_eq_portable(l + i, r + i, n - i));
+}
+
+AVX2 static bool all_le_avx2(const scalar *l, const scalar *r, long n)
+{
+    long	i, j;
+
+    for (i = 0; i + BLOCK <= n; i += BLOCK)
+    {
+	__m256d	fail = _mm256_setzero_pd();
+
+	for (j = i; j < i + BLOCK; j += 4)
+	{
+	    __m256d	lv = _mm256_loadu_pd(l + j), rv = _mm256_loadu_pd(r + j);
+
+	    fail = _mm256_or_pd(fail,
+				_mm256_and_pd(unequal(lv, rv),
+					      _mm256_cmp_pd(lv, rv, _CMP_GT_OQ)));
+	}
+	if (_mm256_movemask_pd(fail))
+	    return(false);
+    }
+    return(all_le_portable(l + i, r + i, n - i));
+}
+
+AVX2 static bool all_ge_avx2(const scalar *l, const scalar *r, long n)
+{
+    long	i, j;
+
+    for (i = 0; i + BLOCK <= n; i += BLOCK)
+    {
+	__m256d	fail = _mm256_setzero_pd();
+
+	for (j = i; j < i + BLOCK; j += 4)
+	{
+	    __m256d	lv = _mm256_loadu_pd(l + j), rv = _mm256_loadu_pd(r + j);
+
+	    fail = _mm256_or_pd(fail,
+				_mm256_and_pd(unequal(lv, rv),
+					      _mm256_cmp_pd(lv, rv, _CMP_LT_OQ)));
+	}
+	if (_mm256_movemask_pd(fail))
+	    return(false);
+    }
+    return(all_ge_portable(l + i, r + i, n - i));
+}
+
+static const kernels avx2 =
+{
+    add_avx2, subtract_avx2, negate_avx2, abs_avx2,
+    all_eq_avx2, all_le_avx2, all_ge_avx2,
+};
+#endif /* HAVE_AVX2_KERNELS */
+
+/****************************************************************************
+ *
+ * Dispatch
+ *
+ ****************************************************************************/
+
+static const kernels *use;	/* the kernels in use */
+
+static const kernels *select_kernels(void)
+/* pick the best kernels this processor can run */
+{
+#ifdef HAVE_AVX2_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+	return(&avx2);
+#endif /* HAVE_AVX2_KERNELS */
+    return(&portable);
+}
+
+#define KERNELS	(use ? use : (use = select_kernels()))
+
+void vec_add(scalar *d, const scalar *l, const scalar *r, long n)
+/* d = l + r, elementwise */
+{
+    KERNELS->add(d, l, r, n);
+}
+
+void vec_subtract(scalar *d, const scalar *l, const scalar *r, long n)
+/* d = l - r, elementwise */
+{
+    KERNELS->subtract(d, l, r, n);
+}
+
+void vec_negate(scalar *d, const scalar *r, long n)
+/* d = -r, elementwise */
+{
+    KERNELS->negate(d, r, n);
+}
+
+void vec_abs(scalar *d, const scalar *r, long n)
+/* d = |r|, elementwise */
+{
+    KERNELS->abs(d, r, n);
+}
+
+bool vec_all_eq(const scalar *l, const scalar *r, long n)
+/* is every element of l fuzzily equal to its correspondent in r? */
+{
+    return(KERNELS->all_eq(l, r, n));
+}
+
+bool vec_all_le(const scalar *l, const scalar *r, long n)
+/* is every element of l less than or fuzzily equal to its correspondent? */
+{
+    return(KERNELS->all_le(l, r, n));
+}
+
+bool vec_all_ge(const scalar *l, const scalar *r, long n)
+/* is every element of l greater than or fuzzily equal to its correspondent? */
+{
+    return(KERNELS->all_ge(l, r, n));
+}
+
+/* simd.c ends here */
@@ -0,0 +1,792 @@
+/*****************************************************************************
+
+NAME
+   translate.c -- translate compiled code to C
+
+SYNOPSIS
+   void translate(node *tree, program *prog)	-- write a program as C
+
+DESCRIPTION
+   This is the compiler back end that monitor.c was split out for.  It
+writes the bytecode compiled from a checked, label-resolved parse tree to
+standard output as a standalone C program, which is built with the
+system C compiler and linked against the runtime library, libcupl.a:
+
+	cupl -c prog.cupl >prog.c
+	cc -O2 -I. prog.c libcupl.a -lm -pthread -o prog
+
+   Each instruction becomes the C statements that run() in execute.c
+would perform for it, so the translation behaves exactly as the
+interpreter does, less the cost of decoding instructions.  Branches
+become gotos to labels placed at their targets; a PERFORM pushes the
+index of the instruction after it and jumps, and RETURN goes through a
+switch on the popped index.  A program with no PERFORM keeps its
+registers in a local array, where the C compiler can keep scalars in
+machine registers; otherwise each activation gets a window of a
+growable register file, as in run().
+
+   The *DATA section becomes a table in the program, and matrix file
+bindings given with -i and -o are compiled in.  The translated program
+takes -d and -j options, with the same meanings as cupl's, at run time.
+Constructs the interpreter hands to cupl_eval() only to report that
+they are not implemented do the same at run time.
+
+LICENSE
+   SPDX-License-Identifier: BSD-2-clause
+
+*****************************************************************************/
+/*LINTLIBRARY*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "cupl.h"
+#include "tokens.h"
+
+/* what parts of the support code the program needs */
+static bool calls;	/* PERFORMs, so register windows */
+static bool reads;	/* READ statements */
+static bool stores;	/* assignments */
+static bool writes;	/* WRITEs of named variables */
+static bool watches;	/* WATCH statements */
+static bool loops;	/* TIMES or FOR loops */
+static bool specials;	/* constants C has no literals for */
+static bool temps;	/* generic operations with a result to hold */
+static bool tests;	/* generic relations */
+static bool registers;	/* anything at all in registers */
+
+/****************************************************************************
+ *
+ * Support code
+ *
+ ****************************************************************************/
+
+static const char *head[] =
+{
+    "#include <stdio.h>",
+    "#include <stdlib.h>",
+    "#include <string.h>",
+    "#include <unistd.h>",
+    "#include <math.h>",
+    "#include \"cupl.h\"",
+    "",
+    "#define STACKSIZE\t64\t/* PERFORM activations to allow for at first */",
+    "",
+    "/* the scalar relations, as in execute.c */",
+    "#define S_EQ(x, y)\tFUZZY_EQUAL(x, y)",
+    "#define S_LE(x, y)\t(FUZZY_EQUAL(x, y) || !((x) > (y)))",
+    "#define S_GE(x, y)\t(FUZZY_EQUAL(x, y) || !((x) < (y)))",
+    "#define S_LT(x, y)\t(S_LE(x, y) && !S_EQ(x, y))",
+    "#define S_GT(x, y)\t(S_GE(x, y) && !S_EQ(x, y))",
+    "#define SCALAR(v, x)\t((v).rank = 0, (v).width = (v).depth = 1, \\",
+    "\t\t\t (v).elements = (scalar *)NULL, (v).number = (x))",
+    "#define TRUTH(v, c)\t((v).rank = (c), (v).elements = (scalar *)NULL)",
+    (char *)NULL,
+};
+
+static const char *datum_code[] =
+{
+    "static int datum;\t\t/* next item of data[] */",
+    "",
+    "static bool next_datum(scalar *x, char **name)",
+    "/* get the next data item, from the data file or the *DATA list */",
+    "{",
+    "    if (data_streaming())",
+    "\treturn(data_next(x, name));",
+    "    else if (datum >= NDATA)",
+    "\treturn(false);",
+    "",
+    "    *name = data[datum].name;",
+    "    *x = data[datum++].x;",
+    "    return(true);",
+    "}",
+    "",
+    "static void read_var(int s)",
+    "/* READ into a variable */",
+    "{",
+    "    value\t*v = &vars[s];",
+    "    scalar\t*elements;",
+    "    char\t*name;",
+    "    int\t\tn;",
+    "",
+    "    unshare_value(v);",
+    "    elements = ELEMENTS(*v);",
+    "",
+    "    for (n = 0; n < v->width * v->depth; n++)",
+    "\tif (!next_datum(&elements[n], &name))",
+    "\t{",
+    "\t    warn(\"data list too short\\n\");",
+    "\t    elements[n] = 1;\t/* 5-2 */",
+    "\t}",
+    "\telse if (name && strcmp(names[s], name))",
+    "\t    warn(\"data mismatch; expecting %s, saw %s\\n\", names[s], name);",
+    "}",
+    "",
+    (char *)NULL,
+};
+
+static const char *write_code[] =
+{
+    "static void write_var(int s)",
+    "/* WRITE a variable */",
+    "{",
+    "    cupl_scalar_write(names[s], ELEMENTS(vars[s])[0]);",
+    "}",
+    "",
+    (char *)NULL,
+};
+
+static const char *assign_code[] =
+{
+    "static void assign(int s, value v)",
+    "/* assign a value to a variable */",
+    "{",
+    "    deallocate_value(&vars[s]);",
+    "    vars[s] = v;",
+    "    if (watchcount[s] && watchcount[s]--)",
+    "    {",
+    "\twrite_var(s);",
+    "\tcupl_eol_write();",
+    "    }",
+    "}",
+    "",
+    (char *)NULL,
+};
+
+static const char *scalarize_code[] =
+{
+    "static void scalarize(value *v)",
+    "/* reduce a value to a scalar holding its first element */",
+    "{",
+    "    if (v->rank > 0)",
+    "    {",
+    "\tscalar\tfirst = v->elements[0];",
+    "",
+    "\tdeallocate_value(v);",
+    "\tmake_scalar(v, first);",
+    "    }",
+    "}",
+    "",
+    (char *)NULL,
+};
+
+static const char *bits_code[] =
+{
+    "static scalar bits(unsigned long long u)",
+    "/* a scalar with the given representation, for infinities and NaNs */",
+    "{",
+    "    scalar\tx;",
+    "",
+    "    memcpy(&x, &u, sizeof(x));",
+    "    return(x);",
+    "}",
+    "",
+    (char *)NULL,
+};
+
+static void lines(const char **text)
+/* copy a block of support code to the output */
+{
+    for (; *text; text++)
+	(void) printf("%s\n", *text);
+}
+
+static void quote(const char *s)
+/* write a string as a C string literal */
+{
+    (void) putchar('"');
+    for (; *s; s++)
+	if (*s == '"' || *s == '\\')
+	    (void) printf("\\%c", *s);
+	else if ((unsigned char)*s < ' ' || (unsigned char)*s >= 0x7f)
+	    (void) printf("\\%03o", (unsigned char)*s);
+	else
+	    (void) putchar(*s);
+    (void) putchar('"');
+}
+
+static void literal(scalar x)
+/* write a scalar as a C expression that reproduces it exactly */
+{
+    if (isfinite(x))
+	(void) printf("%a", x);
+    else
+    {
+	unsigned long long	u;
+
+	memcpy(&u, &x, sizeof(u));
+	(void) printf("bits(0x%016llxULL)", u);
+    }
+}
+
+/****************************************************************************
+ *
+ * Instructions
+ *
+ ****************************************************************************/
+
+static const struct
+{
+    value	(*fn)(value);
+    char	*name;
+}
+fn1names[] =
+{
+    {cupl_atan, "cupl_atan"},	{cupl_cos, "cupl_cos"},
+    {cupl_exp, "cupl_exp"},	{cupl_floor, "cupl_floor"},
+    {cupl_log, "cupl_log"},	{cupl_ln, "cupl_ln"},
+    {cupl_sqrt, "cupl_sqrt"},	{cupl_rand, "cupl_rand"},
+    {cupl_det, "cupl_det"},	{cupl_inv, "cupl_inv"},
+    {cupl_posmax, "cupl_posmax"}, {cupl_posmin, "cupl_posmin"},
+    {cupl_sgm, "cupl_sgm"},	{cupl_trc, "cupl_trc"},
+    {cupl_trn, "cupl_trn"},
+};
+
+static const struct
+{
+    value	(*fn)(value, value);
+    char	*name;
+}
+fn2names[] =
+{
+    {cupl_dot, "cupl_dot"},	{cupl_max, "cupl_max"},
+    {cupl_min, "cupl_min"},
+};
+
+static const struct
+{
+    scalar	(*fn)(scalar);
+    char	*name;
+}
+sfnames[] =
+{
+    {atan, "atan"},	{cos, "cos"},	{exp, "exp"},	{floor, "floor"},
+    {log10, "log10"},	{log, "log"},	{sqrt, "sqrt"},
+};
+
+#define LOOKUP(table, f, out) \
+	{ \
+	    unsigned	k; \
+	    out = (char *)NULL; \
+	    for (k = 0; k < sizeof(table) / sizeof(table[0]); k++) \
+		if (table[k].fn == f) \
+		    out = table[k].name; \
+	    if (out == (char *)NULL) \
+		die("internal error -- unknown intrinsic\n"); \
+	}
+
+static void survey(program *prog)
+/* find out what support code the instructions will need */
+{
+    insn	*ip;
+    node	*np;
+
+    calls = reads = stores = writes = watches = false;
+    loops = specials = temps = tests = registers = false;
+    for (ip = prog->code; ip < prog->code + prog->ninsns; ip++)
+    {
+	if (ip->op != OP_JUMP && ip->op != OP_RETURN && ip->op != OP_STOP
+	    && ip->op != OP_READ && ip->op != OP_WRITE
+	    && ip->op != OP_WATCH && ip->op != OP_EVAL)
+	    registers = true;
+	switch (ip->op)
+	{
+	case OP_CONST:
+	    if (!isfinite(ip->tree->u.numval))
+		specials = true;
+	    break;
+	case OP_STORE:
+	    stores = writes = true;
+	    break;
+	case OP_MULTIPLY: case OP_POWER: case OP_FUNC1: case OP_FUNC2:
+	    temps = true;
+	    break;
+	case OP_EQ: case OP_NE: case OP_LT: case OP_GT: case OP_LE: case OP_GE:
+	    tests = true;
+	    break;
+	case OP_CALL:
+	    calls = true;
+	    break;
+	case OP_TIMES: case OP_FORPREP: case OP_FORLOOP:
+	    loops = true;
+	    break;
+	case OP_READ:
+	    reads = true;
+	    break;
+	case OP_WRITE:
+	    for_cdr(np, ip->tree)
+		if (np->car && np->car->type != STRING
+		    && np->car->type != FWRITE)
+		    writes = true;
+	    break;
+	case OP_WATCH:
+	    watches = true;
+	    break;
+	default:
+	    break;
+	}
+    }
+}
+
+static void write_item(node *tp)
+/* translate a WRITE item */
+{
+    lvar	*lp;
+
+    if (tp == (node *)NULL)
+	(void) printf("    cupl_string_write(\"\");\n");
+    else if (tp->type == ALL)
+    {
+	for_symbols(lp)
+	    if (lp->used || lp->assigned)
+		write_item(lp->node);
+    }
+    else if (tp->type == STRING)
+    {
+	(void) printf("    cupl_string_write(");
+	quote(tp->u.string);
+	(void) printf(");\n");
+    }
+    else if (tp->type == FWRITE)
+	(void) printf("    cupl_scalar_write((char *)NULL, ELEMENTS(vars[%d])[0]);\n",
+		      tp->car->syminf->slot);
+    else
+	(void) printf("    write_var(%d);\n", tp->syminf->slot);
+}
+
+static void translate_insn(program *prog, insn *ip)
+/* translate one instruction into the C run() would perform for it */
+{
+    int		d = ip->dst, a = ip->a, b = ip->b, n = (int)(ip - prog->code);
+    char	*fn;
+    node	*np;
+
+    switch (ip->op)
+    {
+    case OP_CONST:
+	(void) printf("    SCALAR(r[%d], ", d);
+	literal(ip->tree->u.numval);
+	(void) printf(");\n");
+	break;
+
+    case OP_LOAD:
+	(void) printf("    r[%d] = copy_value(vars[%d]);\n", d, ip->slot);
+	break;
+
+    case OP_SLOAD:
+	(void) printf("    r[%d] = vars[%d];\n", d, ip->slot);
+	break;
+
+    case OP_STORE:
+	(void) printf("    assign(%d, r[%d]);\n", ip->slot, a);
+	break;
+
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_DIVIDE:
+	(void) printf("    %s(&r[%d], r[%d], r[%d]);\n",
+		      ip->op == OP_ADD ? "cupl_add_into"
+		      : ip->op == OP_SUBTRACT ? "cupl_subtract_into"
+		      : "cupl_divide_into", a, a, b);
+	(void) printf("    deallocate_value(&r[%d]);\n", b);
+	if (d != a)
+	    (void) printf("    r[%d] = r[%d];\n", d, a);
+	break;
+
+    case OP_MULTIPLY:
+    case OP_POWER:
+    case OP_FUNC2:
+	if (ip->op == OP_FUNC2)
+	    LOOKUP(fn2names, ip->f.fn2, fn)
+	else
+	    fn = (ip->op == OP_MULTIPLY) ? "cupl_multiply" : "cupl_power";
+	(void) printf("    t = %s(r[%d], r[%d]);\n", fn, a, b);
+	(void) printf("    deallocate_value(&r[%d]);\n", a);
+	(void) printf("    deallocate_value(&r[%d]);\n", b);
+	(void) printf("    r[%d] = t;\n", d);
+	break;
+
+    case OP_UMINUS:
+    case OP_ABS:
+	(void) printf("    %s(&r[%d], r[%d]);\n",
+		      ip->op == OP_UMINUS ? "cupl_uminus_into" : "cupl_abs_into",
+		      a, a);
+	if (d != a)
+	    (void) printf("    r[%d] = r[%d];\n", d, a);
+	break;
+
+    case OP_FUNC1:
+	LOOKUP(fn1names, ip->f.fn1, fn)
+	(void) printf("    t = %s(r[%d]);\n", fn, a);
+	(void) printf("    deallocate_value(&r[%d]);\n", a);
+	(void) printf("    r[%d] = t;\n", d);
+	break;
+
+    case OP_EQ: case OP_NE: case OP_LT: case OP_GT: case OP_LE: case OP_GE:
+	switch (ip->op)
+	{
+	case OP_EQ: fn = "cupl_eq"; break;
+	case OP_NE: fn = "!cupl_eq"; break;
+	case OP_LT: fn = "cupl_lt"; break;
+	case OP_GT: fn = "cupl_gt"; break;
+	case OP_LE: fn = "!cupl_gt"; break;
+	default:    fn = "!cupl_lt"; break;
+	}
+	(void) printf("    cond = %s(r[%d], r[%d]);\n", fn, a, b);
+	(void) printf("    deallocate_value(&r[%d]);\n", a);
+	(void) printf("    deallocate_value(&r[%d]);\n", b);
+	(void) printf("    TRUTH(r[%d], cond);\n", d);
+	break;
+
+    case OP_AND:
+    case OP_OR:
+	(void) printf("    r[%d].rank = r[%d].rank %s r[%d].rank;\n",
+		      d, a, ip->op == OP_AND ? "&&" : "||", b);
+	break;
+
+    case OP_JUMP:
+	(void) printf("    goto L%d;\n", ip->target);
+	break;
+
+    case OP_JUMPT:
+    case OP_JUMPF:
+	(void) printf("    if (%sr[%d].rank)\n\tgoto L%d;\n",
+		      ip->op == OP_JUMPT ? "" : "!", a, ip->target);
+	break;
+
+    case OP_CALL:
+	(void) printf("    if (++depth >= maxdepth)\n");
+	(void) printf("\tgrow();\n");
+	(void) printf("    frames[depth] = %d;\n", n + 1);
+	(void) printf("    r = regfile + depth * NREGS;\n");
+	(void) printf("    goto L%d;\n", ip->target);
+	break;
+
+    case OP_RETURN:
+	if (calls)
+	    (void) printf("    goto ret;\n");
+	else
+	    (void) printf("    return(false);\n");
+	break;
+
+    case OP_STOP:
+	(void) printf("    return(true);\n");
+	break;
+
+    case OP_TIMES:
+	(void) printf("    fr = &r[%d];\n", a);
+	(void) printf("    scalarize(fr);\n");
+	(void) printf("    fr->number = (int)floor(fr->number);\n");
+	(void) printf("    if (fr->number == 0)\n\tgoto L%d;\n", ip->target);
+	break;
+
+    case OP_LOOP:
+	(void) printf("    if (--r[%d].number != 0)\n\tgoto L%d;\n",
+		      a, ip->target);
+	break;
+
+    case OP_FORPREP:
+	(void) printf("    fr = &r[%d];\n", a);
+	(void) printf("    scalarize(&fr[0]);\n");
+	(void) printf("    scalarize(&fr[1]);\n");
+	(void) printf("    scalarize(&fr[2]);\n");
+	(void) printf("    if (!(fr[0].number <= fr[1].number))\n\tgoto L%d;\n",
+		      ip->target);
+	(void) printf("    unshare_value(&vars[%d]);\n", ip->slot);
+	(void) printf("    ELEMENTS(vars[%d])[0] = fr[0].number;\n", ip->slot);
+	break;
+
+    case OP_FORLOOP:
+	(void) printf("    fr = &r[%d];\n", a);
+	(void) printf("    fr[0].number += fr[2].number;\n");
+	(void) printf("    if (fr[0].number <= fr[1].number)\n    {\n");
+	(void) printf("\tunshare_value(&vars[%d]);\n", ip->slot);
+	(void) printf("\tELEMENTS(vars[%d])[0] = fr[0].number;\n", ip->slot);
+	(void) printf("\tgoto L%d;\n    }\n", ip->target);
+	break;
+
+    case OP_READ:
+	for_cdr(np, ip->tree)
+	    if (np->car->type != IDENTIFIER)
+		die("internal error -- garbled READ list\n");
+	    else
+		(void) printf("    read_var(%d);\n", np->car->syminf->slot);
+	break;
+
+    case OP_WRITE:
+	(void) printf("    cupl_reset_write();\n");
+	for_cdr(np, ip->tree)
+	    write_item(np->car);
+	(void) printf("    cupl_eol_write();\n");
+	break;
+
+    case OP_WATCH:
+	for_cdr(np, ip->tree)
+	    (void) printf("    watchcount[%d] = 10;\n", np->car->syminf->slot);
+	break;
+
+    case OP_EVAL:
+	/* all that is left for cupl_eval() is what it refuses to do */
+	(void) printf("    die(\"%s is not implemented\\n\");\n",
+		      tokdump(ip->tree->type));
+	break;
+
+    case OP_SADD: case OP_SSUBTRACT: case OP_SMULTIPLY: case OP_SDIVIDE:
+	(void) printf("    SCALAR(r[%d], r[%d].number %c r[%d].number);\n",
+		      d, a, "+-*/"[ip->op - OP_SADD], b);
+	break;
+
+    case OP_SPOWER:
+	(void) printf("    SCALAR(r[%d], pow(r[%d].number, r[%d].number));\n",
+		      d, a, b);
+	break;
+
+    case OP_SUMINUS:
+	(void) printf("    SCALAR(r[%d], -r[%d].number);\n", d, a);
+	break;
+
+    case OP_SABS:
+	(void) printf("    SCALAR(r[%d], fabs(r[%d].number));\n", d, a);
+	break;
+
+    case OP_SFUNC:
+	LOOKUP(sfnames, ip->f.sfn, fn)
+	(void) printf("    SCALAR(r[%d], %s(r[%d].number));\n", d, fn, a);
+	break;
+
+    case OP_SEQ: case OP_SNE: case OP_SLT: case OP_SGT: case OP_SLE: case OP_SGE:
+	switch (ip->op)
+	{
+	case OP_SEQ: fn = "S_EQ"; break;
+	case OP_SNE: fn = "!S_EQ"; break;
+	case OP_SLT: fn = "S_LT"; break;
+	case OP_SGT: fn = "S_GT"; break;
+	case OP_SLE: fn = "!S_GT"; break;
+	default:     fn = "!S_LT"; break;
+	}
+	(void) printf("    TRUTH(r[%d], %s(r[%d].number, r[%d].number));\n",
+		      d, fn, a, b);
+	break;
+
+    default:
+	die("internal error -- bad opcode %d\n", ip->op);
+    }
+}
+
+/****************************************************************************
+ *
+ * Programs
+ *
+ ****************************************************************************/
+
+static void declare(node *tree)
+/* write the program's variables, data and support code */
+{
+    node	*np, *data = NULLNODE;
+    lvar	*lp;
+    int		n = 0;
+
+    (void) printf("#define NSLOTS\t%d\n\n", nslots);
+    (void) printf("int verbose, linewidth = %d, fieldwidth = %d;\n\n",
+		  linewidth, fieldwidth);
+    (void) printf("static value vars[NSLOTS + 1];\n");
+    if (stores || watches)
+	(void) printf("static int watchcount[NSLOTS + 1];\n");
+    if (reads || writes)
+    {
+	(void) printf("static char *names[NSLOTS + 1] =\n{\n");
+	for (n = 0; n < nslots; n++)
+	    for_symbols(lp)
+		if (lp->slot == n)
+		    (void) printf("    \"%s\",\n", lp->node->u.string);
+	(void) printf("    (char *)NULL,\n};\n");
+    }
+    (void) putchar('\n');
+
+    if (reads)
+    {
+	/* execute() takes its data from the first *DATA statement */
+	for_cdr(np, tree)
+	    if (np->car->type == DATA)
+	    {
+		data = np->car;
+		break;
+	    }
+
+	(void) printf("static const struct\n{\n    char\t*name;\n    scalar\tx;\n}\ndata[] =\n{\n");
+	n = 0;
+	for_cdr(np, data)
+	{
+	    (void) printf("    {");
+	    if (np->car->type == NUMBER)
+	    {
+		(void) printf("(char *)NULL, ");
+		literal(np->car->u.numval);
+	    }
+	    else
+	    {
+		quote(np->car->car->u.string);
+		(void) printf(", ");
+		literal(np->car->cdr->u.numval);
+	    }
+	    (void) printf("},\n");
+	    n++;
+	}
+	(void) printf("    {(char *)NULL, 0},\n};\n#define NDATA\t%d\n\n", n);
+    }
+
+    if (specials)
+	lines(bits_code);
+    if (reads)
+	lines(datum_code);
+    if (writes)
+	lines(write_code);
+    if (stores)
+	lines(assign_code);
+    if (loops)
+	lines(scalarize_code);
+}
+
+static void define_run(program *prog)
+/* write the translated code as the function run() */
+{
+    bool	*labelled;
+    insn	*ip;
+    int		n;
+
+    /* labels go at branch targets and the places PERFORMs return to */
+    if ((labelled = (bool *)calloc(prog->ninsns + 1, sizeof(bool))) == (bool *)NULL)
+	die(NOMEM);
+    for (ip = prog->code; ip < prog->code + prog->ninsns; ip++)
+	switch (ip->op)
+	{
+	case OP_CALL:
+	    labelled[ip - prog->code + 1] = true;
+	    /* FALL THROUGH */
+	case OP_JUMP: case OP_JUMPT: case OP_JUMPF:
+	case OP_TIMES: case OP_LOOP: case OP_FORPREP: case OP_FORLOOP:
+	    labelled[ip->target] = true;
+	    break;
+	default:
+	    break;
+	}
+
+    (void) printf("#define NREGS\t%d\n\n", prog->nregs);
+    if (calls)
+    {
+	(void) printf("static value *regfile;\t/* register windows, one per PERFORM activation */\n");
+	(void) printf("static int *frames;\t/* return addresses, one per PERFORM activation */\n");
+	(void) printf("static int maxdepth;\t/* activations allocated */\n\n");
+	(void) printf("static void grow(void)\n");
+	(void) printf("/* make room for more PERFORM activations */\n{\n");
+	(void) printf("    maxdepth = maxdepth ? maxdepth * 2 : STACKSIZE;\n");
+	(void) printf("    regfile = (value *)realloc(regfile, sizeof(value) * maxdepth * NREGS);\n");
+	(void) printf("    frames = (int *)realloc(frames, sizeof(int) * maxdepth);\n");
+	(void) printf("    if (regfile == (value *)NULL || frames == (int *)NULL)\n");
+	(void) printf("\tdie(NOMEM);\n}\n\n");
+    }
+
+    (void) printf("static bool run(void)\n");
+    (void) printf("/* run the program, returning true if it ended with a STOP */\n{\n");
+    if (calls)
+    {
+	(void) printf("    value\t*r;\n");
+	(void) printf("    int\t\tdepth = 0;\n");
+    }
+    else if (registers)
+	(void) printf("    value\tr[NREGS];\n");
+    if (loops)
+	(void) printf("    value\t*fr;\n");
+    if (temps)
+	(void) printf("    value\tt;\n");
+    if (tests)
+	(void) printf("    bool\tcond;\n");
+    (void) putchar('\n');
+    if (calls)
+    {
+	(void) printf("    grow();\n");
+	(void) printf("    r = regfile;\n\n");
+    }
+
+    for (n = 0; n < prog->ninsns; n++)
+    {
+	if (labelled[n])
+	    (void) printf("L%d:\n", n);
+	translate_insn(prog, prog->code + n);
+    }
+
+    if (calls)
+    {
+	(void) printf("\nret:\n");
+	(void) printf("    if (depth == 0)\n\treturn(false);\n");
+	(void) printf("    r = regfile + --depth * NREGS;\n");
+	(void) printf("    switch (frames[depth + 1])\n    {\n");
+	for (ip = prog->code; ip < prog->code + prog->ninsns; ip++)
+	    if (ip->op == OP_CALL)
+	    {
+		n = (int)(ip - prog->code) + 1;
+		(void) printf("    case %d: goto L%d;\n", n, n);
+	    }
+	(void) printf("    }\n");
+	(void) printf("    die(\"internal error -- bad return address\\n\");\n");
+    }
+    (void) printf("}\n\n");
+
+    free(labelled);
+}
+
+static void define_main(void)
+/* write the program's main sequence */
+{
+    binding	*bp;
+
+    (void) printf("int main(int argc, char *argv[])\n{\n");
+    (void) printf("    int\t\tc, n;\n\n");
+    (void) printf("    pool_threads((int)sysconf(_SC_NPROCESSORS_ONLN));\n");
+    (void) printf("    while ((c = getopt(argc, argv, \"d:j:\")) != EOF)\n");
+    (void) printf("\tswitch (c)\n\t{\n");
+    (void) printf("\tcase 'd':\n\t    data_open(optarg);\n\t    break;\n\n");
+    (void) printf("\tcase 'j':\n\t    pool_threads(atoi(optarg));\n\t    break;\n\n");
+    (void) printf("\tdefault:\n");
+    (void) printf("\t    (void) fprintf(stderr, \"usage: %%s [-d file] [-j nn]\\n\", argv[0]);\n");
+    (void) printf("\t    return(1);\n\t}\n\n");
+
+    (void) printf("    for (n = 0; n < NSLOTS; n++)\n\tmake_scalar(&vars[n], 0);\n");
+    for (bp = bindings; bp; bp = bp->next)
+	if (!bp->output)
+	{
+	    int	slot = find_variable(bp->name)->slot;
+
+	    (void) printf("    deallocate_value(&vars[%d]);\n", slot);
+	    (void) printf("    vars[%d] = cupl_load_matrix(", slot);
+	    quote(bp->file);
+	    (void) printf(");\n");
+	}
+
+    (void) printf("\n    if (!run())\n");
+    (void) printf("\twarn(\"program terminated without explicit STOP\\n\");\n\n");
+    (void) printf("    cupl_flush_write();\n");
+    for (bp = bindings; bp; bp = bp->next)
+	if (bp->output)
+	{
+	    (void) printf("    cupl_save_matrix(");
+	    quote(bp->file);
+	    (void) printf(", vars[%d]);\n", find_variable(bp->name)->slot);
+	}
+    (void) printf("    return(0);\n}\n");
+}
+
+void translate(node *tree, program *prog)
+/* write a compiled program as C */
+{
+    survey(prog);
+
+    (void) printf("/* translated from CUPL by cupl -c; link with libcupl.a */\n");
+    lines(head);
+    (void) putchar('\n');
+    declare(tree);
+    define_run(prog);
+    define_main();
+}
+
+/* translate.c ends here */